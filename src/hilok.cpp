@@ -9,297 +9,1426 @@
 
 #include <algorithm>
 #include <cassert>
+#include <condition_variable>
 
-bool lock_with_params(HiMutex &mut, bool block, double timeout) {
-    if (!block) {
-        return mut.try_lock();
-    } else if (timeout != 0.0) {
-        return mut.try_lock_for(timeout);
-    } else {
-        mut.lock();
-        return true;
+HiBiasSlot HiBiasTable::slots[HiBiasTable::num_slots];
+
+namespace {
+
+// where HiIntent and HiUpdate waiters park, picked by the word's address
+struct alignas(64) HiParkSlot {
+    std::mutex m_mutex;
+    std::condition_variable m_cond;
+};
+
+HiParkSlot park_slots[64];
+
+HiParkSlot &park_slot(const void *word) {
+    return park_slots[(reinterpret_cast<uintptr_t>(word) * 0x9E3779B97F4A7C15ULL) >> 58];
+}
+
+// waits until next(old, new) says word can go from old to new, and installs it
+// waiters flag themselves under the slot mutex, so a release that sees the flag can't notify before we wait
+template <class Word, class Next>
+bool park(std::atomic<Word> &word, Word waiters, Next next, const HiWait &wait) {
+    auto &slot = park_slot(&word);
+    std::unique_lock<std::mutex> guard(slot.m_mutex);
+    auto attempt = [&word, &next] (Word &old) {
+        Word want;
+        while (next(old, want)) {
+            if (want == old || word.compare_exchange_weak(old, want, std::memory_order_acquire, std::memory_order_acquire))
+                return true;
+        }
+        return false;
+    };
+    for (;;) {
+        Word old = word.load(std::memory_order_acquire);
+        if (attempt(old))
+            return true;
+        if (!(old & waiters) && !word.compare_exchange_weak(old, old | waiters, std::memory_order_relaxed))
+            continue;
+        if (!wait.m_timed) {
+            slot.m_cond.wait(guard);
+        } else if (slot.m_cond.wait_until(guard, wait.m_deadline) == std::cv_status::timeout) {
+            old = word.load(std::memory_order_acquire);
+            return attempt(old);
+        }
     }
 }
 
-bool shared_lock_with_params(HiMutex &mut, bool block, double timeout) {
-    if (!block) {
-        return mut.try_lock_shared();
-    } else if (timeout != 0.0) {
-        return mut.try_lock_shared_for(timeout);
-    } else {
-        mut.lock_shared();
+// waiters flag themselves again if they still can't go
+template <class Word>
+void unpark(std::atomic<Word> &word, Word waiters) {
+    auto &slot = park_slot(&word);
+    std::lock_guard<std::mutex> guard(slot.m_mutex);
+    word.fetch_and(static_cast<Word>(~waiters), std::memory_order_relaxed);
+    slot.m_cond.notify_all();
+}
+
+}
+
+bool HiIntent::lock_slow(std::atomic<uint32_t> &word, Kind kind, unsigned num, const HiWait &wait) {
+    return park(word, WAITERS, [kind, num] (uint32_t old, uint32_t &want) {
+        want = added(old, kind, num);
+        return want != 0;
+    }, wait);
+}
+
+bool HiIntent::wait_slow(std::atomic<uint32_t> &word, Kind kind, unsigned num, const HiWait &wait) {
+    return park(word, WAITERS, [kind, num] (uint32_t old, uint32_t &want) {
+        want = old;
+        return added(old, kind, num) != 0;
+    }, wait);
+}
+
+void HiIntent::wake(std::atomic<uint32_t> &word) {
+    unpark(word, WAITERS);
+}
+
+bool HiUpdate::lock_slow(std::atomic<uint8_t> &word, const HiWait &wait) {
+    return park(word, WAITERS, [] (uint8_t old, uint8_t &want) {
+        want = old | HELD;
+        return !(old & HELD);
+    }, wait);
+}
+
+bool HiUpdate::wait_upgraded(std::atomic<uint8_t> &word, const HiWait &wait) {
+    if (!(word.load(std::memory_order_acquire) & UPGRADING))
         return true;
-    }
+    return wait.m_block && park(word, WAITERS, [] (uint8_t old, uint8_t &want) {
+        want = old;
+        return !(old & UPGRADING);
+    }, wait);
 }
 
+void HiUpdate::wake(std::atomic<uint8_t> &word) {
+    unpark(word, WAITERS);
+}
 
-void HiHandle::release() {
-    if (m_released) return;
-    m_released = true;
-    auto cur = m_ref;
-    std::vector<std::shared_ptr<HiKeyNode>> refs;
-    while ( cur ) {
-        refs.push_back(cur);
-        cur = cur->m_key.first;
-    }
-    for (auto it = refs.rbegin(); it!= refs.rend(); ) {
-        auto &kref = *it;
-        ++it;
-        if (m_shared || it != refs.rend()) {
-#ifdef HILOK_TRACE
-            std::cout << "un: " << kref << " " << 0 << " " << m_shared << std::endl;
-#endif
-            if (m_mgr->m_flags & HiFlags::LOOSE_READ_UNLOCK)
-                kref->m_mut.unlock_shared(m_src_thread);
-            else 
-                kref->m_mut.unlock_shared();
-        } else {
+// unlocks one node of a handle, exclusive for a write handle's leaf
+template <class Policy, class Node>
+static void unlock_node(Node *kref, bool exclusive, std::thread::id src_thread) {
 #ifdef HILOK_TRACE
-            std::cout << "un: " << kref << " " << 1 << " " << m_shared << std::endl;
+    std::cout << "un: " << kref << " " << exclusive << std::endl;
 #endif
-            if (m_mgr->m_flags & HiFlags::LOOSE_WRITE_UNLOCK)
-                kref->m_mut.unlock(m_src_thread);
-            else 
-                kref->m_mut.unlock();
+    if (!exclusive) {
+        if constexpr (Policy::loose_read)
+            kref->m_mut.unlock_shared(src_thread);
+        else 
+            kref->m_mut.unlock_shared();
+    } else {
+        if constexpr (Policy::loose_write)
+            kref->m_mut.unlock(src_thread);
+        else 
+            kref->m_mut.unlock();
+    }
+}
+
+// what a lock holds on one node of its path: a shared or exclusive lock, or the update bit with a shared lock,
+// and the intent it adds on top, a rename moves all of it or none of it
+struct HiStep {
+    enum Lock : uint8_t { SHARED, EXCLUSIVE, UPDATE };
+
+    Lock m_lock;
+    HiIntent::Kind m_intent;
+};
+
+// what a mode takes on its leaf: S, SIX or U on top of the leaf's lock
+static HiStep leaf_step(HiMode mode) {
+    switch (mode) {
+    case HiMode::UPDATE:
+        return HiStep{HiStep::UPDATE, HiIntent::NONE};
+    case HiMode::READ_TREE:
+        return HiStep{HiStep::SHARED, HiIntent::S};
+    case HiMode::SIX:
+        return HiStep{HiStep::SHARED, HiIntent::SIX};
+    case HiMode::WRITE:
+        return HiStep{HiStep::EXCLUSIVE, HiIntent::NONE};
+    default:
+        return HiStep{HiStep::SHARED, HiIntent::NONE};
+    }
+}
+
+// and on the nodes above it
+static HiStep path_step(HiMode mode) {
+    return HiStep{HiStep::SHARED, hi_mode_intends_write(mode) ? HiIntent::IX : HiIntent::NONE};
+}
+
+enum class HiStepResult { LOCKED, MOVED, FAILED };
+
+// takes step on nod, a child of parent, and counts it under nod's gate, where a rename reads the counts it moves
+// MOVED if a rename took nod away from parent first, then nothing is held, like on FAILED
+template <class Node>
+static HiStepResult lock_step(Node *nod, Node *parent, HiStep step, const HiWait &wait) {
+    auto &mut = nod->m_mut;
+    bool intent = step.m_intent != HiIntent::NONE;
+    // a shared lock tries it all in the gate first, a fast reader's slot can't be counted later
+    if (step.m_lock == HiStep::SHARED) {
+        mut.lock_gate_shared();
+        if (nod->m_parent.get() != parent) {
+            mut.unlock_gate_shared();
+            return HiStepResult::MOVED;
+        }
+        bool ok = mut.lock_shared(HiWait(false));
+        if (ok && intent && !mut.lock_intent(step.m_intent, HiWait(false))) {
+            mut.unlock_shared();
+            ok = false;
+        }
+        mut.unlock_gate_shared();
+        if (ok)
+            return HiStepResult::LOCKED;
+        if (!wait.m_block)
+            return HiStepResult::FAILED;
+    }
+    // then wait for the lock outside of it
+    bool ok;
+    if (step.m_lock == HiStep::EXCLUSIVE) {
+        ok = mut.acquire(wait);
+    } else if (step.m_lock == HiStep::UPDATE) {
+        // the update bit first, waiting for it with the shared lock held would hold up the upgrade we wait for
+        ok = mut.lock_update(wait);
+        if (ok && !(ok = mut.acquire_shared(wait)))
+            mut.unlock_update();
+    } else {
+        ok = mut.acquire_shared(wait);
+    }
+    if (!ok)
+        return HiStepResult::FAILED;
+    // and count it once the intent fits too, which we wait for outside the gate as well
+    for (;;) {
+        mut.lock_gate_shared();
+        bool moved = nod->m_parent.get() != parent;
+        bool got = !moved && (!intent || mut.lock_intent(step.m_intent, HiWait(false)));
+        if (got) {
+            if (step.m_lock == HiStep::EXCLUSIVE) {
+                mut.count_exclusive();
+            } else {
+                mut.count_shared();
+                if (step.m_lock == HiStep::UPDATE)
+                    mut.count_update();
+            }
+        }
+        mut.unlock_gate_shared();
+        if (got)
+            return HiStepResult::LOCKED;
+        if (moved || !mut.wait_intent(step.m_intent, wait)) {
+            if (step.m_lock == HiStep::EXCLUSIVE) {
+                mut.drop();
+            } else {
+                mut.drop_shared();
+                if (step.m_lock == HiStep::UPDATE)
+                    mut.unlock_update();
+            }
+            return moved ? HiStepResult::MOVED : HiStepResult::FAILED;
         }
-        m_mgr->erase_safe(kref);
     }
 }
 
-std::shared_ptr<HiHandle> HiLok::read(std::shared_ptr<HiLok> mgr, std::string_view path, bool block, double timeout) {
-    std::shared_ptr<HiKeyNode> cur;   // root is an empty ptr
+// undoes lock_step under the gate like it, and returns nod's parent as of then
+// intents go before the node's lock
+template <class Policy, class Node>
+static Node *unlock_step(Node *nod, HiStep step, std::thread::id src_thread) {
+    auto &mut = nod->m_mut;
+    mut.lock_gate_shared();
+    if (step.m_lock == HiStep::UPDATE)
+        mut.unlock_update();
+    else if (step.m_intent != HiIntent::NONE)
+        mut.unlock_intent();
+    unlock_node<Policy>(nod, step.m_lock == HiStep::EXCLUSIVE, src_thread);
+    auto parent = nod->m_parent.get();
+    mut.unlock_gate_shared();
+    return parent;
+}
+
+// an intent on a node our caller's lock already holds, counted under its gate like a lock step
+template <class Node>
+static bool lock_intent_step(Node *nod, HiIntent::Kind kind, const HiWait &wait) {
+    auto &mut = nod->m_mut;
+    for (;;) {
+        mut.lock_gate_shared();
+        bool ok = mut.lock_intent(kind, HiWait(false));
+        mut.unlock_gate_shared();
+        if (ok)
+            return true;
+        if (!mut.wait_intent(kind, wait))
+            return false;
+    }
+}
+
+template <class Node>
+static Node *unlock_intent_step(Node *nod) {
+    nod->m_mut.lock_gate_shared();
+    nod->m_mut.unlock_intent();
+    auto parent = nod->m_parent.get();
+    nod->m_mut.unlock_gate_shared();
+    return parent;
+}
+
+// a rename only changes a node's parent link with the gate held
+template <class Node>
+static Node *parent_of(Node *nod) {
+    nod->m_mut.lock_gate_shared();
+    auto parent = nod->m_parent.get();
+    nod->m_mut.unlock_gate_shared();
+    return parent;
+}
+
+// releases what a lock holds from leaf up to base, leaf_step on the leaf and path_step above it,
+// and with IX on its path, the IX it added above base up to cover
+// a rename moves a node's locks along with it, so this follows the parent links as they are when it gets to each node
+// erasing, each node is erased if it's idle, while we still hold its parent
+// a node that stays is still its parent's child, so nothing above it can be erased either
+template <class Policy, class Mgr, class Node>
+static void release_path(Mgr *mgr, Node *leaf, Node *base, Node *cover, HiStep leaf_step, HiStep path_step, std::thread::id src_thread, bool erasing = true) {
+    auto step = leaf_step;
+    for (auto cur = leaf; cur && cur != base; ) {
+        auto parent = unlock_step<Policy>(cur, step, src_thread);
+        if (erasing)
+            erasing = mgr->idle(cur, parent);
+        step = path_step;
+        cur = parent;
+    }
+    // the IX we added to the nodes the lock we started below holds
+    if (path_step.m_intent == HiIntent::IX)
+        for (auto cur = base; cur != cover; )
+            cur = unlock_intent_step(cur);
+    // the lock we started below may be gone already, then its nodes were only kept for ours
+    for (auto cur = base; erasing && cur; ) {
+        auto parent = parent_of(cur);
+        erasing = mgr->idle(cur, parent);
+        cur = parent;
+    }
+}
+
+// locks a pinned chain root first, and backs out on failure, or if a rename took a node away from the one before it
+template <class Policy, class Mgr, class Node>
+static HiStepResult lock_chain(Mgr *mgr, const std::vector<Node *> &chain, bool shared, const HiWait &wait) {
+    HiMode mode = shared ? HiMode::READ : HiMode::WRITE;
+    Node *parent = nullptr;
+    for (auto nod : chain) {
+        auto res = lock_step(nod, parent, nod == chain.back() ? leaf_step(mode) : path_step(mode), wait);
+        if (res != HiStepResult::LOCKED) {
+            // pinned nodes can't be erased
+            release_path<Policy>(mgr, parent, static_cast<Node *>(nullptr), static_cast<Node *>(nullptr), path_step(mode), path_step(mode), std::this_thread::get_id(), false);
+            return res;
+        }
+        parent = nod;
+    }
+    return HiStepResult::LOCKED;
+}
+
+// unlocks what lock_chain locked, or what's left of it after renames
+template <class Policy, class Mgr, class Node>
+static void unlock_chain(Mgr *mgr, Node *leaf, bool shared, std::thread::id src_thread) {
+    HiMode mode = shared ? HiMode::READ : HiMode::WRITE;
+    release_path<Policy>(mgr, leaf, static_cast<Node *>(nullptr), static_cast<Node *>(nullptr), leaf_step(mode), path_step(mode), src_thread, false);
+}
+
+template <class Policy>
+void HiLockT<Policy>::release() {
+    if (!m_held) return;
+    m_held = false;
+    // one pass up from the leaf, our ref keeps the whole chain alive through the parent links
+    release_path<Policy>(m_mgr, m_ref.get(), m_base.get(), m_cover.get(), leaf_step(m_mode), path_step(m_mode), m_src_thread);
+    m_ref.reset();
+    m_base.reset();
+    m_mgr->collect();
+}
+
+template <class Policy>
+HiLockT<Policy> HiLockT<Policy>::lock_child(std::string_view relpath, HiMode mode, const HiWait &wait) const {
+    if (!m_held)
+        throw HiErr("handle is released");
+    if (m_mode == HiMode::READ_TREE && hi_mode_intends_write(mode))
+        throw HiErr("can't write below a READ_TREE lock, lock it SIX");
+    // below a WRITE or SIX lock, the IX above us is already held, below an UPDATE lock, the IX above its node
+    node_ref cover = m_cover;
+    if (hi_mode_writes_below(m_mode))
+        cover = m_ref;
+    else if (m_mode == HiMode::UPDATE && m_ref)
+        cover = node_ref(parent_of(m_ref.get()));
+    return m_mgr->lock_below(m_ref, relpath, mode, wait, std::move(cover));
+}
+
+template <class Policy>
+void HiLockT<Policy>::upgrade(const HiWait &wait) {
+    if (!m_held)
+        throw HiErr("handle is released");
+    if (m_mode != HiMode::UPDATE)
+        throw HiErr("only an UPDATE lock can be upgraded");
+    if (m_src_thread != std::this_thread::get_id())
+        throw HiErr("upgrading from the wrong thread");
+    if (auto leaf = m_ref.get()) {
+        // it's unlocked for a moment, like a new locker, m_inref keeps it from being erased meanwhile
+        leaf->m_inref++;
+        bool ok = leaf->m_mut.upgrade(wait);
+        leaf->m_inref--;
+        if (!ok)
+            throw HiErr("failed to lock");
+    }
+    m_mode = HiMode::WRITE;
+}
+
+// per thread cache of resolved paths, for HiFlags::CACHE_PATHS
+// an entry pins its chain with a ref and m_inref on every node, so they can't be erased or freed while cached,
+// only moved by a rename, which bumps the manager's generation
+// entries only point at their manager weakly, and never touch the nodes once it's gone, their pool went with it
+template <class Core>
+class HiPathCache {
+public:
+    typedef typename Core::node_type node_type;
+
+    struct Entry {
+        std::weak_ptr<Core> m_owner;
+        const Core *m_core = nullptr;
+        uint64_t m_generation = 0;
+        std::string m_path;
+        std::vector<node_type *> m_chain;   // root first
+    };
+
+    static HiPathCache &get() {
+        thread_local HiPathCache cache;
+        return cache;
+    }
+
+    HiPathCache() = default;
+    HiPathCache(const HiPathCache &) = delete;
+    HiPathCache & operator= (const HiPathCache &) = delete;
+
+    ~HiPathCache() {
+        for (auto &e : m_slots)
+            drop(e);
+    }
+
+    Entry &slot(const Core *core, std::string_view path) {
+        uint64_t h = std::hash<std::string_view>()(path) ^ reinterpret_cast<uintptr_t>(core);
+        return m_slots[(h * 0x9E3779B97F4A7C15ULL) >> 56];
+    }
+
+    // the entry for path, if it's there and no rename has happened since
+    // the caller keeps core alive
+    Entry *find(const Core *core, std::string_view path) {
+        auto &e = slot(core, path);
+        if (e.m_core != core || e.m_path != path || e.m_owner.expired())
+            return nullptr;
+        if (e.m_generation != core->m_generation.load(std::memory_order_acquire)) {
+            drop(e);
+            return nullptr;
+        }
+        return &e;
+    }
+
+    static void drop(Entry &e) {
+        if (auto core = e.m_owner.lock())
+            core->unpin(e.m_chain);
+        e.m_owner.reset();
+        e.m_core = nullptr;
+        e.m_chain.clear();
+    }
+
+    // drops every entry for core
+    void flush(const Core *core) {
+        for (auto &e : m_slots)
+            if (e.m_core == core)
+                drop(e);
+    }
+
+private:
+    std::array<Entry, 256> m_slots;
+};
+
+// resolves path, creating nodes as needed, and pins every node on it like the path cache does
+template <class MutexPolicy>
+auto HiLokCore<MutexPolicy>::pin(std::string_view path) -> std::vector<node_type *> {
+    std::vector<node_type *> chain;
+    PathTokens toks(path, m_sep);
+    node_type *cur = nullptr;
     try {
-        std::pair<std::shared_ptr<HiKeyNode>, std::string> key;
-        for (auto it = PathSplit(path, m_sep); it != it.end(); ++it) {
-            key = {cur, *it};
-            std::shared_ptr<HiKeyNode> nod = _get_node(key);
-            bool ok = shared_lock_with_params(nod->m_mut, block, timeout);
-            nod->m_inref--;
-            if (!ok) {
-                throw HiErr("failed to lock");
-            }
-#ifdef HILOK_TRACE
-            std::cout << "lk: " << key.first << "/" << key.second << "->" << nod << " " << 0 << std::endl;
-#endif
-            cur = nod; 
+        for (size_t i = 0; i < toks.size(); ++i) {
+            // _get_node bumps m_inref, our pin on cur keeps it from going away
+            node_ref nod = _get_node(cur, toks[i]);
+            nod->add_ref();
+            chain.push_back(nod.get());
+            cur = nod.get();
         }
     } catch (...) {
-        auto hh = HiHandle(mgr, true, cur);
-        cur.reset(); // decrement refcount for erase_safe
-        hh.release();
+        unpin(chain);
         throw;
     }
-    return std::make_shared<HiHandle>(mgr, true, cur);
+    return chain;
 }
 
-std::shared_ptr<HiKeyNode> HiLok::_get_node(const std::pair<std::shared_ptr<HiKeyNode>, std::string> &key) {
-    std::lock_guard<std::mutex> guard(m_mutex);
-    auto it = m_map.find(key);
-    std::shared_ptr<HiKeyNode> ret;
-    if (it == m_map.end()) {
-        ret = m_map[key] = std::make_shared<HiKeyNode>(key, m_flags);
-    } else {
-        ret = it->second;
+template <class MutexPolicy>
+void HiLokCore<MutexPolicy>::unpin(const std::vector<node_type *> &chain) {
+    if (chain.empty())
+        return;
+    for (auto nod : chain)
+        nod->m_inref--;
+    // a rename may have moved the leaf since, so erase along where it is now, leaf first like a release
+    // our refs keep the old chain alive until we're done, the leaf's parent links keep the new one
+    auto erase_up = [this] (node_type *nod) {
+        while (nod) {
+            auto parent = parent_of(nod);
+            if (!idle(nod, parent))
+                break;
+            nod = parent;
+        }
+    };
+    erase_up(chain.back());
+    // and what it left behind of the old chain
+    for (size_t i = chain.size() - 1; i-- > 0; )
+        if (parent_of(chain[i + 1]) != chain[i])
+            erase_up(chain[i]);
+    for (auto nod : chain)
+        node_ref::adopt(nod);
+    collect();
+}
+
+template <class Policy>
+void HiLokT<Policy>::cache_path(const std::shared_ptr<HiLokT> &mgr, std::string_view path, uint64_t generation, node_type *leaf) {
+    // caller holds the whole chain locked, so it's all in the trie
+    typedef HiPathCache<core_type> cache_type;
+    auto &e = cache_type::get().slot(this, path);
+    cache_type::drop(e);
+    for (auto cur = leaf; cur; cur = parent_of(cur)) {
+        cur->add_ref();
+        cur->m_inref++;
+        e.m_chain.push_back(cur);
+    }
+    std::reverse(e.m_chain.begin(), e.m_chain.end());
+    e.m_owner = mgr;
+    e.m_core = this;
+    e.m_generation = generation;
+    e.m_path.assign(path.data(), path.size());
+}
+
+template <class Policy>
+auto HiLokT<Policy>::lock_cached(const std::shared_ptr<HiLokT> &mgr, std::string_view path, bool shared, const HiWait &wait) -> std::shared_ptr<handle_type> {
+    typedef HiPathCache<core_type> cache_type;
+    auto &cache = cache_type::get();
+    auto e = cache.find(this, path);
+    if (!e)
+        return nullptr;
+    // pinned nodes need no lookups and no m_inref dance, just the locks
+    auto res = lock_chain<Policy>(this, e->m_chain, shared, wait);
+    if (res == HiStepResult::FAILED)
+        throw HiErr("failed to lock");
+    // a rename that started while we were locking may have moved things, then go the long way
+    if (res == HiStepResult::LOCKED) {
+        if (e->m_generation == this->m_generation.load(std::memory_order_acquire))
+            return std::make_shared<handle_type>(mgr, lock_type(this, shared ? HiMode::READ : HiMode::WRITE, node_ref(e->m_chain.back())));
+        unlock_chain<Policy>(this, e->m_chain.back(), shared, std::this_thread::get_id());
     }
-    ret->m_inref++;
+    cache_type::drop(*e);
+    return nullptr;
+}
+
+template <class Policy>
+void HiLokT<Policy>::flush_path_cache() {
+    HiPathCache<core_type>::get().flush(this);
+}
+
+template <class Policy>
+auto HiLokT<Policy>::prepare(std::shared_ptr<HiLokT> mgr, std::string_view path) -> std::shared_ptr<HiPreparedT<Policy>> {
+    return std::make_shared<HiPreparedT<Policy>>(std::move(mgr), path);
+}
+
+template <class Policy>
+HiPreparedT<Policy>::Pin::~Pin() {
+    m_mgr->unpin(m_chain);
+}
+
+template <class Policy>
+void HiPreparedT<Policy>::Handle::release() {
+    if (m_released) return;
+    m_released = true;
+    if (!m_pin->m_chain.empty())
+        unlock_chain<Policy>(m_pin->m_mgr.get(), m_pin->m_chain.back(), m_shared, m_src_thread);
+    m_pin.reset();
+}
+
+template <class Policy>
+std::shared_ptr<HiHandle> HiPreparedT<Policy>::Handle::read_child(std::string_view relpath, bool block, double timeout) {
+    if (m_released)
+        throw HiErr("handle is released");
+    auto &mgr = m_pin->m_mgr;
+    auto base = m_pin->m_chain.empty() ? nullptr : m_pin->m_chain.back();
+    return std::make_shared<typename lok_type::handle_type>(mgr, mgr->lock_below(typename lok_type::node_ref(base), relpath, HiMode::READ, HiWait(block, timeout)));
+}
+
+template <class Policy>
+std::shared_ptr<HiHandle> HiPreparedT<Policy>::Handle::write_child(std::string_view relpath, bool block, double timeout) {
+    if (m_released)
+        throw HiErr("handle is released");
+    auto &mgr = m_pin->m_mgr;
+    typename lok_type::node_ref base(m_pin->m_chain.empty() ? nullptr : m_pin->m_chain.back());
+    // a write handle's ancestors have its IX already
+    auto cover = m_shared ? typename lok_type::node_ref() : base;
+    return std::make_shared<typename lok_type::handle_type>(mgr, mgr->lock_below(base, relpath, HiMode::WRITE, HiWait(block, timeout), cover));
+}
+
+template <class Policy>
+HiPreparedT<Policy>::HiPreparedT(std::shared_ptr<lok_type> mgr, std::string_view path) : m_path(path) {
+    m_pin = make_pin(mgr);
+}
+
+template <class Policy>
+auto HiPreparedT<Policy>::make_pin(const std::shared_ptr<lok_type> &mgr) -> std::shared_ptr<Pin> {
+    auto pin = std::make_shared<Pin>();
+    pin->m_mgr = mgr;
+    // read first, a rename that runs while we resolve leaves us stale, not wrong
+    pin->m_generation = mgr->m_generation.load(std::memory_order_acquire);
+    pin->m_chain = mgr->pin(m_path);
+    return pin;
+}
+
+template <class Policy>
+std::shared_ptr<HiHandle> HiPreparedT<Policy>::lock(bool shared, bool block, double timeout) {
+    HiWait wait(block, timeout);     // retries share the deadline
+    for (;;) {
+        std::shared_ptr<Pin> pin;
+        {
+            std::lock_guard<std::mutex> guard(m_mutex);
+            pin = m_pin;
+        }
+        auto res = lock_chain<Policy>(pin->m_mgr.get(), pin->m_chain, shared, wait);
+        if (res == HiStepResult::FAILED)
+            throw HiErr("failed to lock");
+        if (res == HiStepResult::LOCKED) {
+            if (pin->m_generation == pin->m_mgr->m_generation.load(std::memory_order_acquire))
+                return std::make_shared<Handle>(std::move(pin), shared);
+            if (!pin->m_chain.empty())
+                unlock_chain<Policy>(pin->m_mgr.get(), pin->m_chain.back(), shared, std::this_thread::get_id());
+        }
+        // a rename may have moved some of our nodes, resolve the path again
+        auto fresh = make_pin(pin->m_mgr);
+        std::lock_guard<std::mutex> guard(m_mutex);
+        if (m_pin == pin)
+            m_pin = std::move(fresh);
+    }
+}
+
+template <class Policy>
+auto HiLokT<Policy>::read(std::shared_ptr<HiLokT> mgr, std::string_view path, const HiWait &wait) -> std::shared_ptr<handle_type> {
+    uint64_t generation = this->m_generation.load(std::memory_order_acquire);
+    if (this->m_cache_paths)
+        if (auto hh = lock_cached(mgr, path, true, wait))
+            return hh;
+    if (!this->m_cache_paths)
+        return std::make_shared<handle_type>(std::move(mgr), lock_below(node_ref(), path, HiMode::READ, wait));
+    auto hh = std::make_shared<handle_type>(mgr, lock_below(node_ref(), path, HiMode::READ, wait));
+    if (auto leaf = hh->leaf())
+        cache_path(mgr, path, generation, leaf);
+    return hh;
+}
+
+template <class MutexPolicy>
+auto HiLokCore<MutexPolicy>::_get_node(node_type *parent, std::string_view name) -> node_ref {
+    // the caller holds the parent, so it can't go away, and nobody else can add or remove its children's locks
+    key_type key(name);
+    auto &table = children(parent);
+    node_ref ret;
+    if (table.lock_shared()) {
+        if (auto nod = table.find(key)) {
+            ret = node_ref(nod);
+            ret->m_inref++;
+        }
+        table.unlock_shared();
+        if (ret)
+            return ret;
+    }
+
+    node_ref created;
+    table.lock();
+    try {
+        if (auto nod = table.find(key)) {
+            ret = node_ref(nod);
+        } else {
+            created = node_ref(m_pool.create(node_ref(parent), name, m_names.get()));
+            table.insert(created);
+            m_size++;
+            ret = created;
+        }
+        ret->m_inref++;
+    } catch (...) {
+        table.unlock();
+        throw;
+    }
+    table.unlock();
     return ret;
 }
 
 
-std::shared_ptr<HiHandle> HiLok::write(std::shared_ptr<HiLok> mgr, std::string_view path, bool block, double timeout) {
-    std::shared_ptr<HiKeyNode> cur;
+template <class Policy>
+auto HiLokT<Policy>::write(std::shared_ptr<HiLokT> mgr, std::string_view path, const HiWait &wait) -> std::shared_ptr<handle_type> {
+    uint64_t generation = this->m_generation.load(std::memory_order_acquire);
+    if (this->m_cache_paths)
+        if (auto hh = lock_cached(mgr, path, false, wait))
+            return hh;
+    if (!this->m_cache_paths)
+        return std::make_shared<handle_type>(std::move(mgr), lock_below(node_ref(), path, HiMode::WRITE, wait));
+    auto hh = std::make_shared<handle_type>(mgr, lock_below(node_ref(), path, HiMode::WRITE, wait));
+    if (auto leaf = hh->leaf())
+        cache_path(mgr, path, generation, leaf);
+    return hh;
+}
+
+template <class Policy>
+auto HiLokT<Policy>::lock(std::shared_ptr<HiLokT> mgr, std::string_view path, HiMode mode, const HiWait &wait) -> std::shared_ptr<handle_type> {
+    if (mode == HiMode::READ)
+        return read(std::move(mgr), path, wait);
+    if (mode == HiMode::WRITE)
+        return write(std::move(mgr), path, wait);
+    return std::make_shared<handle_type>(std::move(mgr), lock_below(node_ref(), path, mode, wait));
+}
+
+template <class Policy>
+auto HiLokT<Policy>::lock_many(std::shared_ptr<HiLokT> mgr, const std::vector<std::pair<std::string_view, HiMode>> &paths, const HiWait &wait) -> std::shared_ptr<multi_handle_type> {
+    struct Request {
+        PathTokens m_toks;
+        HiMode m_mode;
+    };
+    std::vector<Request> reqs;
+    reqs.reserve(paths.size());
+    for (auto &p : paths)
+        reqs.push_back(Request{PathTokens(p.first, this->m_sep), p.second});
+    // tree order: component by component, ancestors first
+    auto common_prefix = [] (const PathTokens &a, const PathTokens &b) {
+        size_t common = 0;
+        while (common < a.size() && common < b.size() && a[common] == b[common])
+            ++common;
+        return common;
+    };
+    std::sort(reqs.begin(), reqs.end(), [&common_prefix] (const Request &a, const Request &b) {
+        size_t common = common_prefix(a.m_toks, b.m_toks);
+        if (common < a.m_toks.size() && common < b.m_toks.size())
+            return a.m_toks[common] < b.m_toks[common];
+        return a.m_toks.size() < b.m_toks.size();
+    });
+
+    // requests for the same path merge into a mode that gives both
+    size_t num = 0;
+    for (size_t i = 0; i < reqs.size(); ++i) {
+        if (num && reqs[i].m_toks.size() == reqs[num - 1].m_toks.size() && common_prefix(reqs[i].m_toks, reqs[num - 1].m_toks) == reqs[i].m_toks.size()) {
+            reqs[num - 1].m_mode = hi_mode_merge(reqs[num - 1].m_mode, reqs[i].m_mode);
+            continue;
+        }
+        if (num != i)
+            reqs[num] = std::move(reqs[i]);
+        ++num;
+    }
+    reqs.erase(reqs.begin() + num, reqs.end());
+
+    // a READ_TREE above a path that intends to write would keep out our own intents, it becomes SIX
+    std::vector<Request *> above;
+    for (auto &req : reqs) {
+        while (!above.empty() && common_prefix(above.back()->m_toks, req.m_toks) < above.back()->m_toks.size())
+            above.pop_back();
+        if (hi_mode_intends_write(req.m_mode))
+            for (auto anc : above)
+                if (anc->m_mode == HiMode::READ_TREE)
+                    anc->m_mode = HiMode::SIX;
+        above.push_back(&req);
+    }
+
+    // each path is locked below the deepest node the locks before it hold, which the previous path shares the most of
+    // if a lock fails, the handle releases the ones before it
+    auto handle = std::make_shared<multi_handle_type>(std::move(mgr));
+    const Request *prev = nullptr;
+    std::vector<bool> intent;   // nodes of the previous path that have our IX, X or SIX, root first, an UPDATE leaf has none
+    for (auto &req : reqs) {
+        auto &toks = req.m_toks;
+        size_t common = 0;
+        node_ref base;
+        if (prev) {
+            common = common_prefix(prev->m_toks, toks);
+            auto nod = handle->m_locks.back().leaf();
+            for (size_t up = prev->m_toks.size(); up > common; --up)
+                nod = parent_of(nod);
+            base = node_ref(nod);
+        }
+        intent.resize(common);
+        // a path that intends to write only needs IX above base up to the deepest node with ours
+        node_ref cover;
+        bool ix = hi_mode_intends_write(req.m_mode);
+        if (ix) {
+            size_t covered = common;
+            while (covered > 0 && !intent[covered - 1])
+                --covered;
+            auto nod = base.get();
+            for (size_t up = common; up > covered; --up)
+                nod = parent_of(nod);
+            cover = node_ref(nod);
+            std::fill(intent.begin(), intent.end(), true);
+        }
+        intent.resize(toks.size(), ix);
+        if (!intent.empty() && common < toks.size())
+            intent.back() = hi_mode_writes_below(req.m_mode);
+        std::string_view rel;
+        if (common < toks.size()) {
+            auto first = toks[common], last = toks[toks.size() - 1];
+            rel = std::string_view(first.data(), last.data() + last.size() - first.data());
+        }
+        handle->m_locks.push_back(lock_below(std::move(base), rel, req.m_mode, wait, std::move(cover)));
+        prev = &req;
+    }
+    return handle;
+}
+
+template <class Policy>
+auto HiLokT<Policy>::lock_below(node_ref base, std::string_view path, HiMode mode, const HiWait &wait, node_ref cover) -> lock_type {
+    auto step = path_step(mode);
+    if (step.m_intent == HiIntent::IX) {
+        // the nodes our caller holds above us get our IX first, an S or SIX on any of them is a real conflict
+        auto nod = base.get();
+        for (; nod != cover.get(); nod = parent_of(nod))
+            if (!lock_intent_step(nod, HiIntent::IX, wait))
+                break;
+        if (nod != cover.get()) {
+            for (auto undo = base.get(); undo != nod; )
+                undo = unlock_intent_step(undo);
+            throw HiErr("failed to lock");
+        }
+    }
+    node_ref cur = base;    // an empty base is the root
+    PathTokens toks(path, this->m_sep);
     try {
-        std::pair<std::shared_ptr<HiKeyNode>, std::string> key;
-        for (auto it = PathSplit(path, m_sep); it != it.end(); ) {
-            key = {cur, *it};
-            std::shared_ptr<HiKeyNode> nod = _get_node(key);
+        for (size_t i = 0; i < toks.size(); ) {
+            node_ref nod = this->_get_node(cur.get(), toks[i]);
             
-            ++it;
-            bool ok;
-            if (it != it.end())
-                ok = shared_lock_with_params(nod->m_mut, block, timeout);
-            else
-                ok = lock_with_params(nod->m_mut, block, timeout);
+            bool last = i + 1 == toks.size();
+            // ancestors: IX if we intend to write, leaf: what the mode reads the subtree with
+            auto res = lock_step(nod.get(), cur.get(), last ? leaf_step(mode) : step, wait);
             nod->m_inref--;
 
-            if (!ok) {
+            if (res == HiStepResult::FAILED) {
                 throw HiErr("failed to lock");
             }
+            // a rename took it away from cur before we got it, look again
+            if (res == HiStepResult::MOVED)
+                continue;
 
 #ifdef HILOK_TRACE
-            std::cout << "lk: " << key.first << "/" << key.second << "->" << nod << " " << !(it != it.end()) << std::endl;
+            std::cout << "lk: " << cur.get() << "/" << nod->m_name.view() << "->" << nod.get() << " " << static_cast<int>(last ? mode : HiMode::READ) << std::endl;
 #endif
-            cur = nod;
+            // the new node's parent link keeps the old one alive
+            cur = std::move(nod);
+            ++i;
         }
     } catch (...) {
-        auto hh = HiHandle(mgr, true, cur);
-        cur.reset(); // decrement refcount for erase_safe
-        hh.release();
+        // everything taken so far was a path step
+        release_path<Policy>(this, cur.get(), base.get(), cover.get(), step, step, std::this_thread::get_id());
+        this->collect();
         throw;
     }
 
-    return std::make_shared<HiHandle>(mgr, false, cur);
+    return lock_type(this, mode, std::move(cur), std::move(base), std::move(cover));
 }
 
-std::shared_ptr<HiKeyNode> HiLok::find_node(std::string_view path_from) {
-    auto it_from = PathSplit(path_from, m_sep);
-    auto leaf_from = it_from;
-    std::shared_ptr<HiKeyNode> cur;
-    std::pair<std::shared_ptr<HiKeyNode>, std::string> key;
-    while (it_from != it_from.end()) {
-        leaf_from = it_from;
-        ++it_from;
-
-        key = {cur, *leaf_from};
-
-        auto it = m_map.find(key);
-        if (it == m_map.end()) {
+template <class MutexPolicy>
+auto HiLokCore<MutexPolicy>::find_node(std::string_view path_from) -> node_ref {
+    PathTokens path(path_from, m_sep);
+    node_ref cur;
+    for (size_t i = 0; i < path.size(); ++i) {
+        // the ref we hold keeps the table we're looking in alive
+        auto &table = children(cur.get());
+        if (!table.lock_shared())
+            return {};
+        node_ref nod(table.find(key_type(path[i])));
+        table.unlock_shared();
+        if (!nod) {
             return {};
-        } else {
-            cur = it->second;
         }
+        cur = std::move(nod);
     }
     return cur;
 }
 
-void HiLok::rename(std::string_view path_from, std::string_view path_to, bool block, double secs) {
-    std::lock_guard<std::mutex> guard(m_mutex);
-    
-    auto leaf_from_node = find_node(path_from);
-    if (!leaf_from_node)
-        throw HiErr("rename source lock not found");
-
-    std::pair<std::shared_ptr<HiKeyNode>, std::string> to_key;
-    
-    auto it_from = PathSplit(path_from, m_sep);
-    
-    bool common = true;
-    auto it_to = PathSplit(path_to, m_sep);
-    auto leaf_to = it_to;
-    std::shared_ptr<HiKeyNode> cur_to;
-    std::shared_ptr<HiKeyNode> cur_from;
-    std::pair<std::shared_ptr<HiKeyNode>, std::string> from_key;
-    while (it_to != it_to.end()) {
-        leaf_to = it_to;
-        to_key = {cur_to, *leaf_to};
-
-        ++it_to;
-        if (common) {
-            // common ancestor nodes can be ignored
-            from_key = {cur_to, *it_from};
-            ++it_from;
-            if (to_key == from_key) {
+namespace {
+
+// exclusive locks on several child tables, released in reverse
+template <class Table>
+class HiTableGuard {
+    std::vector<Table *> m_held;
+public:
+    HiTableGuard() = default;
+    HiTableGuard(const HiTableGuard &) = delete;
+    HiTableGuard & operator= (const HiTableGuard &) = delete;
+
+    ~HiTableGuard() {
+        for (auto it = m_held.rbegin(); it != m_held.rend(); ++it)
+            (*it)->unlock();
+    }
+
+    void hold(Table &table) {
+        if (std::find(m_held.begin(), m_held.end(), &table) != m_held.end())
+            return;
+        table.lock();
+        m_held.push_back(&table);
+    }
+};
+
+// the first num components of a path, each followed by sep, so equal paths are equal strings
+// and an ancestor's string is a prefix of its descendants'
+std::string join_path(const PathTokens &toks, size_t num, char sep) {
+    std::string ret;
+    for (size_t i = 0; i < num; ++i) {
+        ret.append(toks[i].data(), toks[i].size());
+        ret.push_back(sep);
+    }
+    return ret;
+}
+
+}
+
+template <class MutexPolicy>
+void HiLokCore<MutexPolicy>::rename_many(const std::vector<std::pair<std::string_view, std::string_view>> &moves, const HiWait &wait) {
+    // renames are serialized, waiting for another one counts against the same deadline as the locks
+    std::unique_lock<recursive_shared_mutex> serial(m_rename_mutex, std::defer_lock);
+    if (!wait.m_block)
+        serial.try_lock();
+    else if (wait.m_timed)
+        serial.try_lock_until(wait.m_deadline);
+    else
+        serial.lock();
+    if (!serial)
+        throw HiErr("failed to lock");
+
+    struct Move {
+        PathTokens m_from;
+        PathTokens m_to;
+        size_t m_first_uncommon;
+        node_ref m_leaf;
+        size_t m_pins;                          // index of the destination ancestors' pinned chain
+        size_t m_cloned;                        // destination ancestors holding the leaf's lock counts
+        typename HiMutexT<MutexPolicy>::Held m_held;    // the counts they hold
+        std::vector<node_type *> m_from_chain;
+    };
+    std::vector<Move> batch;
+    batch.reserve(moves.size());
+    for (auto &mv : moves) {
+        batch.push_back(Move{PathTokens(mv.first, m_sep), PathTokens(mv.second, m_sep), 0, {}, 0, 0, {}, {}});
+        auto &m = batch.back();
+        if (!m.m_from.size())
+            throw HiErr("rename source lock not found");
+        if (!m.m_to.size())
+            throw HiErr("rename destination is empty");
+        // common ancestors are left alone
+        size_t common = 0;
+        while (common < m.m_from.size() && common < m.m_to.size() && m.m_from[common] == m.m_to[common])
+            ++common;
+        if (common == m.m_from.size() && m.m_to.size() > m.m_from.size())
+            throw HiErr("cannot rename a lock to a path below itself");
+        m.m_first_uncommon = std::min(common, m.m_to.size() - 1);
+    }
+
+    if (batch.size() > 1) {
+        // moves are done one after the other, which is only the same as all at once if they don't touch each other's paths
+        // sorted, a path's descendants follow it, so each path only needs checking against the chain of paths above it
+        std::vector<std::pair<std::string, size_t>> leaves;
+        for (size_t i = 0; i < batch.size(); ++i) {
+            leaves.emplace_back(join_path(batch[i].m_from, batch[i].m_from.size(), m_sep), i);
+            leaves.emplace_back(join_path(batch[i].m_to, batch[i].m_to.size(), m_sep), i);
+        }
+        std::sort(leaves.begin(), leaves.end());
+        std::vector<const std::pair<std::string, size_t> *> above;
+        for (auto &leaf : leaves) {
+            while (!above.empty() && leaf.first.compare(0, above.back()->first.size(), above.back()->first) != 0)
+                above.pop_back();
+            for (auto up : above)
+                if (up->second != leaf.second)
+                    throw HiErr("renamed paths overlap");
+            above.push_back(&leaf);
+        }
+    }
+
+    // look up the sources, moves out of one directory share the parent's lookup
+    std::unordered_map<std::string, node_ref> from_parents;
+    for (auto &m : batch) {
+        auto key = join_path(m.m_from, m.m_from.size() - 1, m_sep);
+        auto it = from_parents.find(key);
+        if (it == from_parents.end()) {
+            node_ref parent;
+            if (m.m_from.size() > 1 && !(parent = find_node(key)))
+                throw HiErr("rename source lock not found");
+            it = from_parents.emplace(std::move(key), std::move(parent)).first;
+        }
+        auto &table = children(it->second.get());
+        if (table.lock_shared()) {
+            m.m_leaf = node_ref(table.find(key_type(m.m_from[m.m_from.size() - 1])));
+            table.unlock_shared();
+        }
+        if (!m.m_leaf)
+            throw HiErr("rename source lock not found");
+    }
+
+    // then, with no table held, get or create the destination's ancestors and clone each leaf's lock counts onto them
+    // this is the part that can block, pinned nodes can't be erased while we wait
+    // moves into one directory share its pins
+    struct Pins {
+        HiLokCore &m_core;
+        std::vector<std::vector<node_type *>> m_chains;
+        ~Pins() {
+            for (auto &chain : m_chains)
+                m_core.unpin(chain);
+        }
+    } pins{*this, {}};
+    std::unordered_map<std::string, size_t> to_parents;
+    for (auto &m : batch) {
+        auto key = join_path(m.m_to, m.m_to.size() - 1, m_sep);
+        auto it = to_parents.find(key);
+        if (it == to_parents.end()) {
+            pins.m_chains.push_back(pin(key));
+            it = to_parents.emplace(std::move(key), pins.m_chains.size() - 1).first;
+        }
+        m.m_pins = it->second;
+    }
+    // a timed out rename leaves nothing behind, unpinning erases the ancestors we created
+    auto unclone = [&] () {
+        for (auto &m : batch) {
+            auto &to_chain = pins.m_chains[m.m_pins];
+            for (size_t i = m.m_first_uncommon; i < m.m_first_uncommon + m.m_cloned; ++i)
+                to_chain[i]->m_mut.unsafe_clone_unlock_shared(m.m_held);
+            m.m_cloned = 0;
+        }
+    };
+    // the leaf's counts can change until we hold its gate, the commit checks them again
+    auto clone = [&] () {
+        for (auto &m : batch) {
+            auto &to_chain = pins.m_chains[m.m_pins];
+            m.m_held = m.m_leaf->m_mut.held();
+            for (size_t i = m.m_first_uncommon; i < to_chain.size(); ++i) {
 #ifdef HILOK_TRACE
-                std::cout << "ig: " << to_key.first << "/" << to_key.second << std::endl;
+                std::cout << "clon lk: " << m.m_to[i] << ":" << to_chain[i] << " " << m.m_held.m_locks << std::endl;
 #endif
-                auto it = m_map.find(to_key);
-                cur_to = it->second;
-                cur_from = it->second;
-                continue;
+                if (!to_chain[i]->m_mut.unsafe_clone_lock_shared(m.m_held, wait)) {
+                    unclone();
+                    throw HiErr("unable to lock rename dest");
+                }
+                ++m.m_cloned;
             }
-            common = false;
         }
+    };
+    // with the commit's tables held, only what doesn't wait
+    auto reclone = [&] (Move &m, const typename HiMutexT<MutexPolicy>::Held &now) {
+        auto &to_chain = pins.m_chains[m.m_pins];
+        size_t i = m.m_first_uncommon;
+        for (; i < to_chain.size(); ++i)
+            if (!to_chain[i]->m_mut.unsafe_clone_lock_shared(now, HiWait(false)))
+                break;
+        if (i < to_chain.size()) {
+            while (i-- > m.m_first_uncommon)
+                to_chain[i]->m_mut.unsafe_clone_unlock_shared(now);
+            return false;
+        }
+        for (i = m.m_first_uncommon; i < to_chain.size(); ++i)
+            to_chain[i]->m_mut.unsafe_clone_unlock_shared(m.m_held);
+        m.m_held = now;
+        return true;
+    };
 
-        if (it_to != it_to.end()) {
-            // non-leaf destination
-            // get or create node, as needed for the destination
-            // clone lock counts && thread ids from the leaf
+    std::vector<node_ref> dropped;      // refs the tables gave up, released after the tables are
+    for (;;) {
+        clone();
 
-            auto it = m_map.find(to_key);
-            if (it == m_map.end()) {
-                cur_to = m_map[to_key] = std::make_shared<HiKeyNode>(to_key, m_flags);
-            } else {
-                cur_to = it->second;
+        // then the commit, which never waits on a node
+        // it locks every table it looks at, parents first, until it's done
+        // nothing can be erased from a held table, so plain pointers to the nodes in them stay valid
+        HiTableGuard<table_type> held;
+        // cached chains from before or during the commit are stale, bumped again before the tables unlock
+        struct Bump {
+            std::atomic<uint64_t> &m_gen;
+            explicit Bump(std::atomic<uint64_t> &gen) : m_gen(gen) { m_gen.fetch_add(1, std::memory_order_acq_rel); }
+            ~Bump() { m_gen.fetch_add(1, std::memory_order_acq_rel); }
+        } bump(m_generation);
+
+        // the source chains, root first, a leaf may have gone while we weren't holding anything
+        // all of them are checked before anything moves
+        for (auto &m : batch) {
+            node_type *cur = nullptr;
+            m.m_from_chain.clear();
+            for (size_t i = 0; i < m.m_from.size(); ++i) {
+                auto &table = children(cur);
+                held.hold(table);
+                cur = table.find(key_type(m.m_from[i]));
+                if (!cur)
+                    break;
+                m.m_from_chain.push_back(cur);
             }
+            if (cur != m.m_leaf.get()) {
+                unclone();
+                throw HiErr("rename source lock not found");
+            }
+        }
+        // and the destinations, an eraser holds a table while it reads a node's parent under its gate
+        // so we can't wait for one with a gate held
+        for (auto &m : batch) {
+            auto &to_chain = pins.m_chains[m.m_pins];
+            held.hold(children(to_chain.empty() ? nullptr : to_chain.back()));
+        }
 
-#ifdef HILOK_TRACE
-            std::cout << "clon was: " << cur_to->m_mut.m_num_r << std::endl;
-#endif
+        // the leaves' gates stay held until they hang in their new place, so no lock on them is counted or let go meanwhile
+        // one that changed since we cloned is caught up, or if that would wait, we let go of everything and clone again
+        struct Gates {
+            std::vector<node_type *> m_held;
+            ~Gates() {
+                for (auto nod : m_held)
+                    nod->m_mut.unlock_gate();
+            }
+        } gates;
+        bool changed = false;
+        for (auto &m : batch) {
+            m.m_leaf->m_mut.lock_gate();
+            gates.m_held.push_back(m.m_leaf.get());
+            auto now = m.m_leaf->m_mut.held();
+            if (now != m.m_held && !reclone(m, now)) {
+                changed = true;
+                break;
+            }
+        }
+        if (changed) {
+            unclone();
+            continue;
+        }
 
+        for (auto &m : batch) {
+            auto &from_chain = m.m_from_chain;
+            auto &to_chain = pins.m_chains[m.m_pins];
+            node_type *leaf_from_node = m.m_leaf.get();
+            node_type *to_parent = to_chain.empty() ? nullptr : to_chain.back();
+
+            // unlock the source ancestors that aren't destination ancestors
+            // if the destination is an ancestor of the source, it's replaced by the leaf, so it's unlocked too
+            for (size_t i = m.m_first_uncommon; i + 1 < from_chain.size(); ++i) {
 #ifdef HILOK_TRACE
-            std::cout << "clon lk: " << to_key.first << "/" << to_key.second << ":" << cur_to << " " << leaf_from_node->m_mut.m_num_r + leaf_from_node->m_mut.m_is_ex << std::endl;
+                std::cout << "clon un: " << from_chain[i]->m_name.view() << ":" << from_chain[i] << " " << m.m_held.m_locks << std::endl;
 #endif
-            // copy lock counts from the leaf to the ancestor
-            if (!cur_to->m_mut.unsafe_clone_lock_shared(leaf_from_node->m_mut, block, secs)) {
-                throw HiErr("unable to lock rename dest");
+                from_chain[i]->m_mut.unsafe_clone_unlock_shared(m.m_held);
             }
 
-#ifdef HILOK_TRACE
-            std::cout << "clon new: " << cur_to->m_mut.m_num_r << std::endl;
-#endif
-        }
-    }
+            // keep leaf locks, only change where it hangs
+            node_type *from_parent = from_chain.size() > 1 ? from_chain[from_chain.size() - 2] : nullptr;
+            dropped.push_back(children(from_parent).take(leaf_from_node));
 
-    std::vector<std::shared_ptr<HiKeyNode>> to_erase;
+            // then the old ancestors can go, leaf side first
+            for (size_t i = from_chain.size() - 1; i-- > m.m_first_uncommon; ) {
+                if (auto nod = erase_unsafe(from_chain[i]))
+                    dropped.push_back(std::move(nod));
+            }
 
-    while (it_from != it_from.end()) {
-        // uncommon ancestor of source must be released
+            // releasers read the parent links under the gate, leave them alone if they don't change
+            if (leaf_from_node->m_parent.get() != to_parent)
+                leaf_from_node->m_parent = node_ref(to_parent);
+            leaf_from_node->m_name = HiName(m.m_to[m.m_to.size() - 1], m_names.get());
+            if (auto replaced = children(to_parent).insert(m.m_leaf)) {
+                m_size--;
+                dropped.push_back(std::move(replaced));
+            }
+        }
+        return;
+    }
+}
 
-        auto it = m_map.find(from_key);
 
-        // we already tested for this above, and we have a mutex, should never happen
-        assert(it != m_map.end());
+template <class MutexPolicy>
+bool HiLokCore<MutexPolicy>::erase_safe(node_type *ref, node_type *parent) {
+    node_ref doomed;
+    bool gone = true;
+    auto &table = children(parent);
+    table.lock();
+    // rename may have moved it or replaced it since the caller looked, then it's not ours to erase
+    if (parent_of(ref) == parent && table.find(ref->key()) == ref) {
+        doomed = erase_unsafe(ref);
+        gone = static_cast<bool>(doomed);
+    }
+    table.unlock();
+    return gone;
+}
 
-        cur_from = it->second;
+template <class MutexPolicy>
+bool HiLokCore<MutexPolicy>::idle(node_type *ref, node_type *parent) {
+    // a node that's busy or has children fails the erase anyway, don't bother retaining it
+    if (m_retain_max.load(std::memory_order_relaxed) && ref->m_inref == 0 && ref->m_children.size() == 0) {
+        retain(ref);
+        return false;
+    }
+    if (m_defer_erase) {
+        retire(ref);
+        return false;
+    }
+    return erase_safe(ref, parent);
+}
 
-#ifdef HILOK_TRACE
-        std::cout << "clon un: " << from_key.first << "/" << from_key.second << ":" << cur_from << " " << leaf_from_node->m_mut.m_num_r + leaf_from_node->m_mut.m_is_ex << std::endl;
-#endif
-        // unlock uncommon ancestors of the source
-        cur_from->m_mut.unsafe_clone_unlock_shared(leaf_from_node->m_mut);
+template <class MutexPolicy>
+void HiLokCore<MutexPolicy>::retire(node_type *ref) {
+    // the release stops here, the batch erases the parents that were only kept for it
+    auto &sh = retire_shard();
+    std::lock_guard<std::mutex> guard(sh.m_mutex);
+    sh.m_nodes.emplace_back(ref);
+}
 
-        to_erase.push_back(cur_from);
+template <class MutexPolicy>
+void HiLokCore<MutexPolicy>::collect() {
+    if (!m_defer_erase)
+        return;
+    auto &sh = retire_shard();
+    std::vector<node_ref> batch;
+    {
+        std::lock_guard<std::mutex> guard(sh.m_mutex);
+        if (sh.m_nodes.size() < retire_batch)
+            return;
+        batch.swap(sh.m_nodes);
+    }
+    for (auto &nod : batch)
+        evict(std::move(nod));
+}
 
-        from_key = {cur_from, *it_from};
-        
-        ++it_from;
+template <class MutexPolicy>
+void HiLokCore<MutexPolicy>::reclaim() {
+    for (auto &sh : m_retired) {
+        std::vector<node_ref> batch;
+        {
+            std::lock_guard<std::mutex> guard(sh.m_mutex);
+            batch.swap(sh.m_nodes);
+        }
+        for (auto &nod : batch)
+            evict(std::move(nod));
     }
-   
-    // lower refs for erase hint
-    from_key.first.reset();
-    cur_to.reset();
-    cur_from.reset();
+}
 
-    for (auto &nod : to_erase) {
-        erase_unsafe(nod);
+template <class MutexPolicy>
+void HiLokCore<MutexPolicy>::retain(node_type *ref) {
+    auto &sh = retain_shard(ref);
+    node_ref victim;
+    {
+        std::lock_guard<std::mutex> guard(sh.m_mutex);
+        uint64_t seq = ++sh.m_seq;
+        sh.m_queue.emplace_back(node_ref(ref), seq);
+        sh.m_last[ref] = seq;
+        // hot nodes leave a trail of stale entries, sweep them out before they outnumber the live ones
+        if (sh.m_queue.size() > 2 * sh.m_last.size() + 16) {
+            std::deque<std::pair<node_ref, uint64_t>> live;
+            for (auto &it : sh.m_queue)
+                if (sh.m_last[it.first.get()] == it.second)
+                    live.push_back(std::move(it));
+            sh.m_queue.swap(live);
+        }
+        if (sh.m_last.size() > m_retain_max.load(std::memory_order_relaxed))
+            victim = pop_oldest(sh);
     }
+    if (victim)
+        evict(std::move(victim));
+}
 
-    // keep leaf locks, only change key
-    m_map.erase(leaf_from_node->m_key);
-    leaf_from_node->m_key = to_key;
-    m_map[to_key] = leaf_from_node;        
+template <class MutexPolicy>
+auto HiLokCore<MutexPolicy>::pop_oldest(RetainShard &sh) -> node_ref {
+    // caller holds the shard mutex, and the shard isn't empty
+    for (;;) {
+        auto front = std::move(sh.m_queue.front());
+        sh.m_queue.pop_front();
+        auto it = sh.m_last.find(front.first.get());
+        if (it->second == front.second) {
+            sh.m_last.erase(it);
+            return std::move(front.first);
+        }
+    }
 }
 
+template <class MutexPolicy>
+void HiLokCore<MutexPolicy>::evict(node_ref victim) {
+    // it may be busy again, then its next release puts it back
+    // our ref keeps the parents alive while we go up, they may have only been kept for it
+    for (auto nod = victim.get(); nod; ) {
+        auto parent = parent_of(nod);
+        if (!erase_safe(nod, parent))
+            break;
+        nod = parent;
+    }
+}
 
-void HiLok::erase_safe(std::shared_ptr<HiKeyNode> &ref) {
-    std::lock_guard<std::mutex> guard(m_mutex);
-    erase_unsafe(ref);
+template <class MutexPolicy>
+void HiLokCore<MutexPolicy>::set_idle_retention(size_t max) {
+    size_t per_shard = (max + num_retain_shards - 1) / num_retain_shards;
+    m_retain_max.store(per_shard, std::memory_order_relaxed);
+    for (auto &sh : m_retained) {
+        for (;;) {
+            node_ref victim;
+            {
+                std::lock_guard<std::mutex> guard(sh.m_mutex);
+                if (sh.m_last.size() <= per_shard)
+                    break;
+                victim = pop_oldest(sh);
+            }
+            evict(std::move(victim));
+        }
+    }
 }
 
-void HiLok::erase_unsafe(std::shared_ptr<HiKeyNode> &ref) {
-    // lazy speedup, there can be lots of refs (parent->child ref, caller refs, etc.)
-    // but if there are too many, we know the exclusive cannot work and is not worth even trying
-    if (ref.use_count() <= 5 && ref->m_inref == 0) {
-        // maybe no one else is using it?
-        if (ref->m_mut.try_solo_lock() && ref->m_inref == 0) {
-            // we now have an exclusive lock, so we really know nobody is using it
-            // map + ref 
-            try {
-                auto it = m_map.find(ref->m_key);
-                if (it != m_map.end()) {
-                    if (it->second == ref) {
+template <class MutexPolicy>
+auto HiLokCore<MutexPolicy>::erase_unsafe(node_type *ref) -> node_ref {
+    // new lockers bump m_inref under the table lock before locking, so a node nobody has locked or is about to is unused
+    node_ref doomed;
+    if (ref->m_inref != 0)
+        return doomed;
+    if (!ref->m_mut.try_solo_lock())
+        return doomed;
+    // we now have an exclusive lock, so we really know nobody is using it
+    // and nobody can add children without locking it, so an empty table stays empty
+    if (ref->m_inref == 0 && ref->m_children.size() == 0) {
 #ifdef HILOK_TRACE
-                        std::cout << "erasing " << ref->m_key.second << std::endl;
+        std::cout << "erasing " << ref->m_name.view() << std::endl;
 #endif
-                    // i will only ever erase my own
-                        m_map.erase(it);
-                    }
-                }
-            } catch (...) {
-                        ref->m_mut.unlock();
-                        throw;
-            }
-            ref->m_mut.unlock();
-        }
+        // i will only ever erase my own
+        doomed = children(ref->m_parent.get()).take(ref);
+        if (doomed)
+            m_size--;
     }
+    ref->m_mut.unlock();
+    return doomed;
 }
+
+
+// type-erased node, for HiLok::find_node
+template <class Node>
+class HiKeyNodeView : public HiKeyNode {
+    typename Node::ref_type m_ref;
+
+public:
+    explicit HiKeyNodeView(typename Node::ref_type ref) : m_ref(std::move(ref)) {
+    }
+
+    std::string name() const override {
+        return std::string(m_ref->m_name.view());
+    }
+
+    bool is_locked() override {
+        return m_ref->m_mut.is_locked();
+    }
+
+    int num_shared() override {
+        return m_ref->m_mut.m_num_r;
+    }
+
+    std::shared_ptr<HiKeyNode> parent() override {
+        // a rename only moves it with the gate held, the ref keeps the parent we saw
+        m_ref->m_mut.lock_gate_shared();
+        typename Node::ref_type parent(m_ref->m_parent);
+        m_ref->m_mut.unlock_gate_shared();
+        if (!parent)
+            return nullptr;
+        return std::make_shared<HiKeyNodeView>(std::move(parent));
+    }
+};
+
+// type-erased HiLokT, handles share ownership with the HiLok that created them
+template <class Policy>
+class HiLokImpl : public HiLok::Impl {
+    HiLokT<Policy> m_lok;
+
+    std::shared_ptr<HiLokT<Policy>> alias(const std::shared_ptr<HiLok> &mgr) {
+        return std::shared_ptr<HiLokT<Policy>>(mgr, &m_lok);
+    }
+
+public:
+    HiLokImpl(char sep, int options) : m_lok(sep, options) {
+    }
+
+    std::shared_ptr<HiKeyNode> find_node(std::string_view path) override {
+        auto ref = m_lok.find_node(path);
+        if (!ref)
+            return nullptr;
+        return std::make_shared<HiKeyNodeView<typename HiLokT<Policy>::node_type>>(std::move(ref));
+    }
+
+    std::shared_ptr<HiHandle> read(const std::shared_ptr<HiLok> &mgr, std::string_view path, const HiWait &wait) override {
+        return m_lok.read(alias(mgr), path, wait);
+    }
+
+    std::shared_ptr<HiHandle> write(const std::shared_ptr<HiLok> &mgr, std::string_view path, const HiWait &wait) override {
+        return m_lok.write(alias(mgr), path, wait);
+    }
+
+    std::shared_ptr<HiHandle> lock(const std::shared_ptr<HiLok> &mgr, std::string_view path, HiMode mode, const HiWait &wait) override {
+        return m_lok.lock(alias(mgr), path, mode, wait);
+    }
+
+    void rename(std::string_view from, std::string_view to, const HiWait &wait) override {
+        m_lok.rename(from, to, wait);
+    }
+
+    void rename_many(const std::vector<std::pair<std::string_view, std::string_view>> &moves, const HiWait &wait) override {
+        m_lok.rename_many(moves, wait);
+    }
+
+    std::shared_ptr<HiHandle> lock_many(const std::shared_ptr<HiLok> &mgr, const std::vector<std::pair<std::string_view, HiMode>> &paths, const HiWait &wait) override {
+        return m_lok.lock_many(alias(mgr), paths, wait);
+    }
+
+    size_t size() override {
+        return m_lok.size();
+    }
+
+    void flush_path_cache() override {
+        m_lok.flush_path_cache();
+    }
+
+    void set_idle_retention(size_t max) override {
+        m_lok.set_idle_retention(max);
+    }
+
+    void reclaim() override {
+        m_lok.reclaim();
+    }
+
+    std::shared_ptr<HiPrepared> prepare(const std::shared_ptr<HiLok> &mgr, std::string_view path) override {
+        return m_lok.prepare(alias(mgr), path);
+    }
+
+    void for_each_node(const std::function<void(const void *parent, std::string_view name, const void *node)> &f) override {
+        m_lok.for_each_node([&f](auto *parent, std::string_view name, auto *node) { f(parent, name, node); });
+    }
+};
+
+HiLok::HiLok(char sep, int flags) : m_sep(sep), m_flags(flags) {
+    m_impl = hi_dispatch(flags, [sep, flags](auto policy) -> std::unique_ptr<Impl> {
+        return std::make_unique<HiLokImpl<decltype(policy)>>(sep, flags & ~HiFlags::POLICY_FLAGS);
+    });
+}
+
+template <class Policy>
+class HiMutexImpl : public HiMutex::Impl {
+    HiMutexT<Policy> m_mut;
+
+public:
+    bool is_locked() override { return m_mut.is_locked(); }
+    bool is_recursive() override { return m_mut.is_recursive(); }
+    int num_shared() override { return m_mut.m_num_r; }
+    void lock() override { m_mut.lock(); }
+    bool try_lock() override { return m_mut.try_lock(); }
+    bool try_solo_lock() override { return m_mut.try_solo_lock(); }
+    bool try_lock_for(double secs) override { return m_mut.try_lock_for(secs); }
+    void unlock() override { m_mut.unlock(); }
+    void unlock(std::thread::id tid) override { m_mut.unlock(tid); }
+    void lock_shared() override { m_mut.lock_shared(); }
+    bool try_lock_shared() override { return m_mut.try_lock_shared(); }
+    bool try_lock_shared_for(double secs) override { return m_mut.try_lock_shared_for(secs); }
+    void unlock_shared(bool any_thread) override { m_mut.unlock_shared(any_thread); }
+    void unlock_shared(std::thread::id tid) override { m_mut.unlock_shared(tid); }
+};
+
+HiMutex::HiMutex(int rec_flags) {
+    m_impl = hi_dispatch<HiFlags::MUTEX_FLAGS>(rec_flags, [](auto policy) -> std::unique_ptr<Impl> {
+        return std::make_unique<HiMutexImpl<decltype(policy)>>();
+    });
+}
+
+// every policy a HiLok can pick, for C++ users of HiLokT too
+#define HI_MODES(X, F) X(F) X((F) | 1) X((F) | 2) X((F) | 3)
+#define HI_MUTEX_POLICIES(X, F) HI_MODES(X, F) HI_MODES(X, (F) | HiFlags::READ_BIASED) HI_MODES(X, (F) | HiFlags::FAIR) HI_MODES(X, (F) | HiFlags::READ_BIASED | HiFlags::FAIR)
+#define HI_POLICIES(X) HI_MUTEX_POLICIES(X, 0) HI_MUTEX_POLICIES(X, HiFlags::LOOSE_READ_UNLOCK) HI_MUTEX_POLICIES(X, HiFlags::LOOSE_WRITE_UNLOCK) HI_MUTEX_POLICIES(X, HiFlags::LOOSE_READ_UNLOCK | HiFlags::LOOSE_WRITE_UNLOCK)
+
+#define HI_INSTANTIATE_CORE(F) template class HiLokCore<HiPolicy<(F)>>;
+#define HI_INSTANTIATE(F) template class HiLokT<HiPolicy<(F)>>; template class HiLockT<HiPolicy<(F)>>; template class HiHandleT<HiPolicy<(F)>>; template class HiMultiHandleT<HiPolicy<(F)>>; template class HiPreparedT<HiPolicy<(F)>>;
+
+HI_MUTEX_POLICIES(HI_INSTANTIATE_CORE, 0)
+HI_POLICIES(HI_INSTANTIATE)
@@ -3,17 +3,21 @@
 #include <string_view>
 #include <unordered_map>
 #include <map>
+#include <deque>
 #include <vector>
+#include <array>
+#include <mutex>
 #include <thread>
 #include <atomic>
 #include <cassert>
 #include <shared_mutex>
+#include <functional>
 
 #include "recsh.hpp"
+#include "hiname.hpp"
+#include "hipool.hpp"
 #include "hierr.hpp"
 
-#define mut_op(op) (is_recursive() ? m_r_mut.op() : m_t_mut.op())
-#define mut_op_1(op, a) (is_recursive() ? m_r_mut.op(a) : m_t_mut.op(a))
 
 enum HiFlags { 
      STRICT = 0,                // no recursion, strict release
@@ -23,222 +27,1592 @@ enum HiFlags {
      RECURSIVE_MODE_MASK = 7,   // mask that covers recursive modes
      LOOSE_READ_UNLOCK = 8,     // allow unlocks for read handles to come from other threads
      LOOSE_WRITE_UNLOCK = 16,   // allow unlocks for write handles to come from other threads
+     READ_BIASED = 32,          // hot read-mostly nodes take shared locks via a per-thread slot, writers pay to revoke
+     FAIR = 64,                 // new readers queue behind waiting writers instead of barging (recursive modes)
+     INTERN_NAMES = 128,        // long path components are stored once per lock manager, not once per node
+     CACHE_PATHS = 256,         // each thread remembers the node chains of the paths it locked recently
+     DEFER_ERASE = 512,         // idle nodes are erased in batches, not by the thread that released them
+     ALL_FLAGS = 1023,          // every known flag
+     POLICY_FLAGS = 127,        // flags that pick a compile time policy, the rest are runtime options
+     MUTEX_FLAGS = RECURSIVE_MODE_MASK | READ_BIASED | FAIR,  // flags that change how a node mutex behaves
 };
 
-#define RECURSIVE_MODE(f) (f & RECURSIVE_MODE_MASK)
+#define RECURSIVE_MODE(f) ((f) & RECURSIVE_MODE_MASK)
 
-class HiMutex {
+// compile time view of a set of HiFlags
+template <int Flags>
+struct HiPolicy {
+    static constexpr int flags = Flags;
+    static constexpr int rec_mode = RECURSIVE_MODE(Flags);
+    static constexpr bool recursive = rec_mode != HiFlags::STRICT;
+    static constexpr bool loose_read = (Flags & HiFlags::LOOSE_READ_UNLOCK) != 0;
+    static constexpr bool loose_write = (Flags & HiFlags::LOOSE_WRITE_UNLOCK) != 0;
+    static constexpr bool read_biased = (Flags & HiFlags::READ_BIASED) != 0;
+    static constexpr bool fair = (Flags & HiFlags::FAIR) != 0;
+    // unlock looseness is up to the handles, nodes and mutexes are shared by policies that only differ in that
+    typedef HiPolicy<Flags & HiFlags::MUTEX_FLAGS> mutex_policy;
+};
+
+// recursive modes past RECURSIVE behave like RECURSIVE, unknown bits are ignored
+inline int hi_normalize_flags(int flags) {
+    if (RECURSIVE_MODE(flags) > HiFlags::RECURSIVE)
+        flags = (flags & ~HiFlags::RECURSIVE_MODE_MASK) | HiFlags::RECURSIVE;
+    return flags & HiFlags::ALL_FLAGS;
+}
+
+template <int Mask, int F, class Fn>
+auto hi_dispatch_from(int flags, Fn &&fn) -> decltype(fn(HiPolicy<0>())) {
+    if constexpr (F > Mask) {
+        throw HiErr("invalid lock flags");
+    } else if constexpr ((F & ~Mask) != 0 || RECURSIVE_MODE(F) > HiFlags::RECURSIVE) {
+        return hi_dispatch_from<Mask, F + 1>(flags, std::forward<Fn>(fn));
+    } else {
+        if (flags == F)
+            return fn(HiPolicy<F>());
+        return hi_dispatch_from<Mask, F + 1>(flags, std::forward<Fn>(fn));
+    }
+}
+
+// calls fn(HiPolicy<flags>()), turning runtime flags into a compile time policy
+// only the flags in Mask are looked at, so callers instantiate just the policies they can tell apart
+template <int Mask = HiFlags::POLICY_FLAGS, class Fn>
+auto hi_dispatch(int flags, Fn &&fn) -> decltype(fn(HiPolicy<0>())) {
+    return hi_dispatch_from<Mask, 0>(hi_normalize_flags(flags) & Mask, std::forward<Fn>(fn));
+}
+
+// what a lock takes on its path
+// READ: the node itself, ancestors get intent shared (IS), which is just a shared lock
+// UPDATE: READ that keeps out other UPDATEs and writers of the node, and can be upgraded to WRITE in place, ancestors get IX
+// READ_TREE: the node and everything below it (S), no writes below it can start or be in progress
+// SIX: READ_TREE, for a holder that also writes below it through child locks
+// WRITE: the node and everything below it (X), ancestors get intent exclusive (IX)
+enum class HiMode {
+    READ,
+    UPDATE,
+    READ_TREE,
+    SIX,
+    WRITE,
+};
+
+// the holder can write below the node without an IX on it
+inline bool hi_mode_writes_below(HiMode mode) {
+    return mode == HiMode::SIX || mode == HiMode::WRITE;
+}
+
+// the ancestors get IX
+inline bool hi_mode_intends_write(HiMode mode) {
+    return hi_mode_writes_below(mode) || mode == HiMode::UPDATE;
+}
+
+// a mode that gives both, for two requests of the same path
+inline HiMode hi_mode_merge(HiMode a, HiMode b) {
+    if (a == b || b == HiMode::READ)
+        return a;
+    if (a == HiMode::READ)
+        return b;
+    if ((a == HiMode::READ_TREE && b == HiMode::SIX) || (a == HiMode::SIX && b == HiMode::READ_TREE))
+        return HiMode::SIX;
+    return HiMode::WRITE;
+}
+
+// how long a lock call may wait on each node of its path: not at all, until one deadline, or for as long as it takes
+// a timeout becomes a deadline once, when the call starts, so a deep path can't wait for it once per level
+struct HiWait {
+    typedef std::chrono::steady_clock clock;
+    static constexpr double max_timeout = 1e9;     // longer timeouts block, the deadline would overflow
+
+    bool m_block;
+    bool m_timed;
+    clock::time_point m_deadline;
+
+    explicit HiWait(bool block = true, double timeout = 0) :
+        m_block(block), m_timed(block && timeout != 0.0 && timeout < max_timeout),
+        m_deadline(m_timed ? clock::now() + std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(timeout)) : clock::time_point()) {
+    }
+
+    static HiWait until(clock::time_point deadline) {
+        HiWait ret;
+        ret.m_timed = true;
+        ret.m_deadline = deadline;
+        return ret;
+    }
+};
+
+// multi-granularity intents on a node, held on top of a shared lock on it
+// IX: writers below it, S: readers of its whole subtree, SIX: one reader of the subtree that writes below it too
+// only one kind is held at a time, so one 32 bit word holds it all: kind, count, and a waiters bit
+// the count is wide enough to never saturate, a full count would read as a conflict and park
+// IX-IX and S-S are the only compatible pairs, everything else was already checked by the shared lock
+struct HiIntent {
+    enum Kind : uint32_t { NONE = 0, IX = 1, S = 2, SIX = 3 };
+
+    static const uint32_t COUNT_MASK = 0x1FFFFFFF;
+    static const uint32_t KIND_SHIFT = 29;
+    static const uint32_t KIND_MASK = 3u << KIND_SHIFT;
+    static const uint32_t WAITERS = 0x80000000;
+
+    // the word with num more of kind, 0 if they conflict with what's held
+    static uint32_t added(uint32_t word, Kind kind, unsigned num) {
+        unsigned held = (word & KIND_MASK) >> KIND_SHIFT;
+        unsigned cnt = word & COUNT_MASK;
+        if (held == NONE)
+            return (kind == SIX && num > 1) || num > COUNT_MASK ? 0 : (word & WAITERS) | (kind << KIND_SHIFT) | num;
+        if (held != kind || kind == SIX || cnt + num > COUNT_MASK)
+            return 0;
+        return word + num;
+    }
+
+    static bool lock(std::atomic<uint32_t> &word, Kind kind, unsigned num, const HiWait &wait) {
+        if (!num)
+            return true;
+        uint32_t old = word.load(std::memory_order_relaxed);
+        while (uint32_t next = added(old, kind, num)) {
+            if (word.compare_exchange_weak(old, next, std::memory_order_acquire, std::memory_order_relaxed))
+                return true;
+        }
+        return wait.m_block && lock_slow(word, kind, num, wait);
+    }
+
+    static void unlock(std::atomic<uint32_t> &word, unsigned num) {
+        if (!num)
+            return;
+        uint32_t old = word.load(std::memory_order_relaxed);
+        uint32_t next;
+        do {
+            next = (old & COUNT_MASK) == num ? (old & WAITERS) : old - num;
+        } while (!word.compare_exchange_weak(old, next, std::memory_order_release, std::memory_order_relaxed));
+        if (old & WAITERS)
+            wake(word);
+    }
+
+    // waits until num of kind would go in, without taking them
+    static bool wait_for(std::atomic<uint32_t> &word, Kind kind, unsigned num, const HiWait &wait) {
+        if (!num || added(word.load(std::memory_order_acquire), kind, num))
+            return true;
+        return wait.m_block && wait_slow(word, kind, num, wait);
+    }
+
+    // parks on a slot picked by the word's address, like recursive_shared_mutex's stripes
+    static bool lock_slow(std::atomic<uint32_t> &word, Kind kind, unsigned num, const HiWait &wait);
+    static bool wait_slow(std::atomic<uint32_t> &word, Kind kind, unsigned num, const HiWait &wait);
+    static void wake(std::atomic<uint32_t> &word);
+};
+
+// the update (U) bit of a node, held by one UPDATE lock at a time along with its shared lock, and its upgrade flag
+// an upgrade lets go of the shared lock before it takes the exclusive one, a writer that gets in between backs off
+// COUNTED is set with the holder's lock under the node's gate, it's what a rename sees of the U
+struct HiUpdate {
+    static const uint8_t HELD = 1;
+    static const uint8_t UPGRADING = 2;
+    static const uint8_t COUNTED = 4;
+    static const uint8_t WAITERS = 0x80;
+
+    static bool lock(std::atomic<uint8_t> &word, const HiWait &wait) {
+        uint8_t old = word.load(std::memory_order_relaxed);
+        while (!(old & HELD)) {
+            if (word.compare_exchange_weak(old, old | HELD, std::memory_order_acquire, std::memory_order_relaxed))
+                return true;
+        }
+        return wait.m_block && lock_slow(word, wait);
+    }
+
+    static void clear(std::atomic<uint8_t> &word, uint8_t bits) {
+        if (word.fetch_and(static_cast<uint8_t>(~bits), std::memory_order_release) & WAITERS)
+            wake(word);
+    }
+
+    static bool lock_slow(std::atomic<uint8_t> &word, const HiWait &wait);
+    static bool wait_upgraded(std::atomic<uint8_t> &word, const HiWait &wait);
+    static void wake(std::atomic<uint8_t> &word);
+};
+
+// a node's gate: a lock counts itself on the node under it, shared, and a rename holds it alone
+// while it reads the node's counts and moves it, so a lock is either moved whole or not at all
+// nobody waits for anything else while in it, so it just spins, renames are serialized, so there's one writer at most
+struct HiGate {
+    static const uint16_t WRITER = 0x8000;
+
+    static void lock_shared(std::atomic<uint16_t> &word) {
+        for (int spins = 0; ; backoff(spins)) {
+            uint16_t s = word.load(std::memory_order_relaxed);
+            if (!(s & WRITER) && word.compare_exchange_weak(s, static_cast<uint16_t>(s + 1), std::memory_order_acquire, std::memory_order_relaxed))
+                return;
+        }
+    }
+
+    static void unlock_shared(std::atomic<uint16_t> &word) {
+        word.fetch_sub(1, std::memory_order_release);
+    }
+
+    static void lock(std::atomic<uint16_t> &word) {
+        word.fetch_or(WRITER, std::memory_order_acquire);
+        for (int spins = 0; word.load(std::memory_order_acquire) != WRITER; backoff(spins)) {
+        }
+    }
+
+    static void unlock(std::atomic<uint16_t> &word) {
+        word.fetch_and(static_cast<uint16_t>(~WRITER), std::memory_order_release);
+    }
+
+    static void backoff(int &spins) {
+        if (++spins > 64)
+            std::this_thread::yield();
+    }
+};
+
+// reader slots for READ_BIASED mutexes (BRAVO)
+// a fast reader publishes (mutex, thread) in the slot picked by hashing both, and never touches the mutex itself
+// a writer revokes the bias, then scans all slots and migrates any fast readers into the real mutex
+struct HiBiasSlot {
+    std::atomic<uintptr_t> m_lock;  // owning mutex, 0 when free, BUSY while being claimed or migrated
+    std::thread::id m_tid;          // only valid while m_lock holds a mutex
+};
+
+struct HiBiasTable {
+    static const size_t num_slots = 1024;
+    static const uintptr_t BUSY = 1;
+    static HiBiasSlot slots[num_slots];
+
+    static HiBiasSlot &slot(const void *lock, std::thread::id tid) {
+        uint64_t h = std::hash<std::thread::id>()(tid) ^ reinterpret_cast<uintptr_t>(lock);
+        return slots[(h * 0x9E3779B97F4A7C15ULL) >> 54];
+    }
+};
+
+// READ_BIASED mutex state, empty unless biased
+template <bool Biased>
+struct HiBiasState {
+};
+
+template <>
+struct HiBiasState<true> {
+    // BIAS_ON, SCANNING, and the number of writers pending or holding the lock
+    static const uint32_t BIAS_ON = 1;
+    static const uint32_t BIAS_SCANNING = 2;
+    static const uint32_t BIAS_WRITER = 4;
+    // slow-path reads needed before (re-)enabling the bias, amortizes the cost of a revocation
+    static const uint32_t bias_threshold = 64;
+    std::atomic<uint32_t> m_bias{0};
+    std::atomic<uint32_t> m_bias_ticks{0};
+};
+
+// the mutex a node actually blocks on: recursive_shared_mutex set up for the recursive mode, or a plain one for STRICT
+template <class Policy, bool Recursive = Policy::recursive>
+struct HiBaseMutex : recursive_shared_mutex {
+    HiBaseMutex() : recursive_shared_mutex(Policy::rec_mode == HiFlags::RECURSIVE_WRITE, Policy::rec_mode == HiFlags::RECURSIVE_ONEWAY, Policy::fair) {
+    }
+};
+
+template <class Policy>
+struct HiBaseMutex<Policy, false> : std::shared_timed_mutex {
+};
+
+// node mutex, everything the flags decide is resolved at compile time
+template <class Policy>
+class HiMutexT : private HiBiasState<Policy::read_biased> {
 private: 
-    recursive_shared_mutex m_r_mut;
-    std::shared_timed_mutex m_t_mut;
+    HiBaseMutex<Policy> m_mut;
+
 public:
-    std::thread::id m_ex_id;
     std::atomic<int> m_num_r;
-    int m_rec_flags;
     bool m_is_ex;
+    std::atomic<uint8_t> m_update;      // HiUpdate bits
+    std::atomic<uint16_t> m_gate;       // HiGate, a node's locks count themselves under it
+    std::atomic<uint32_t> m_intent;     // HiIntent word, only changed while a shared lock is held
 
-    HiMutex(int rec_flags) : m_r_mut(RECURSIVE_MODE(rec_flags) == RECURSIVE_WRITE, RECURSIVE_MODE(rec_flags) == RECURSIVE_ONEWAY), m_num_r(0), m_rec_flags(rec_flags), m_is_ex(false) {
+    HiMutexT() : m_num_r(0), m_is_ex(false), m_update(0), m_gate(0), m_intent(0) {
     }
-    HiMutex(bool) = delete;
+
+    HiMutexT(const HiMutexT &) = delete;
+    HiMutexT & operator= (const HiMutexT &) = delete;
 
     bool is_locked() {
+        revoke_bias();
         return (m_num_r > 0) || m_is_ex;
     }
 
-    bool is_recursive() {
-        return RECURSIVE_MODE(m_rec_flags) != 0;
+    static constexpr bool is_recursive() {
+        return Policy::recursive;
+    }
+
+    static constexpr bool is_biased() {
+        return Policy::read_biased;
+    }
+
+    bool lock_intent(HiIntent::Kind kind, const HiWait &wait, unsigned num = 1) {
+        return HiIntent::lock(m_intent, kind, num, wait);
+    }
+
+    void unlock_intent(unsigned num = 1) {
+        HiIntent::unlock(m_intent, num);
+    }
+
+    bool wait_intent(HiIntent::Kind kind, const HiWait &wait, unsigned num = 1) {
+        return HiIntent::wait_for(m_intent, kind, num, wait);
+    }
+
+    bool lock_update(const HiWait &wait) {
+        return HiUpdate::lock(m_update, wait);
+    }
+
+    void count_update() {
+        m_update.fetch_or(HiUpdate::COUNTED);
+    }
+
+    void unlock_update() {
+        HiUpdate::clear(m_update, HiUpdate::HELD | HiUpdate::COUNTED);
+    }
+
+    void lock_gate_shared() {
+        HiGate::lock_shared(m_gate);
+    }
+
+    void unlock_gate_shared() {
+        HiGate::unlock_shared(m_gate);
+    }
+
+    void lock_gate() {
+        HiGate::lock(m_gate);
+    }
+
+    void unlock_gate() {
+        HiGate::unlock(m_gate);
+    }
+
+    // trades the caller's shared lock and update bit for an exclusive lock
+    // writers back off until it's done, so nobody writes the node in between, on failure the caller is still UPDATE
+    // the caller's shared lock stays counted until the exclusive one replaces it under the gate, to a rename it's one lock all along
+    // the shared lock is never a fast reader's, see lock_step in hilok.cpp
+    bool upgrade(const HiWait &wait) {
+        m_update.fetch_or(HiUpdate::UPGRADING);
+        m_mut.unlock_shared();
+        if (lock_exclusive(wait)) {
+            lock_gate_shared();
+            --m_num_r;
+            m_is_ex = true;
+            HiUpdate::clear(m_update, HiUpdate::UPGRADING | HiUpdate::HELD | HiUpdate::COUNTED);
+            unlock_gate_shared();
+            return true;
+        }
+        relock_shared();
+        HiUpdate::clear(m_update, HiUpdate::UPGRADING);
+        return false;
+    }
+
+    // takes back the shared lock a failed upgrade let go of, without waiting behind queued writers
+    // only writers about to back off can hold the node meanwhile, so this never really blocks
+    void relock_shared() {
+        if constexpr (Policy::recursive) {
+            m_mut.relock_shared();
+        } else {
+            while (!m_mut.try_lock_shared())
+                std::this_thread::yield();
+        }
+    }
+
+    // IX held on every ancestor on account of this node: writers of it or below it, and its SIX or UPDATE holder
+    unsigned intents_above() const {
+        uint32_t word = m_intent.load(std::memory_order_acquire);
+        unsigned kind = (word & HiIntent::KIND_MASK) >> HiIntent::KIND_SHIFT;
+        unsigned ret = (m_is_ex ? 1 : 0) + (m_update.load(std::memory_order_acquire) & HiUpdate::COUNTED ? 1 : 0);
+        if (kind == HiIntent::IX || kind == HiIntent::SIX)
+            ret += word & HiIntent::COUNT_MASK;
+        return ret;
     }
 
+    // what a rename moves along with a node: the locks on it, and the IX they hold above it
+    // it only stays put while the caller holds the gate
+    struct Held {
+        int m_locks;
+        unsigned m_intents;
+
+        bool operator == (const Held &other) const {
+            return m_locks == other.m_locks && m_intents == other.m_intents;
+        }
 
-    bool unsafe_clone_lock_shared(HiMutex &src, bool block, double secs) {
-        auto num = (m_num_r + src.m_num_r + (src.m_is_ex ? 1 : 0));
-        while (m_num_r < num) {
-            if (!lock_shared(block, secs)) {
+        bool operator != (const Held &other) const {
+            return !(*this == other);
+        }
+    };
+
+    Held held() {
+        revoke_bias();
+        return Held{m_num_r + (m_is_ex ? 1 : 0), intents_above()};
+    }
+
+    bool unsafe_clone_lock_shared(const Held &src, const HiWait &wait) {
+        auto num = src.m_locks;
+        for (int i = 0; i < num; ++i) {
+            if (!lock_shared(wait)) {
+                while (i-- > 0)
+                    unlock_shared();
                 return false;
             }
         }
+        if (!lock_intent(HiIntent::IX, wait, src.m_intents)) {
+            while (num-- > 0)
+                unlock_shared();
+            return false;
+        }
         return true;
     }
 
-    void unsafe_clone_unlock_shared(HiMutex &src) {
-        auto num = (src.m_num_r + (src.m_is_ex ? 1 : 0));
+    void unsafe_clone_unlock_shared(const Held &src) {
+        unlock_intent(src.m_intents);
+        auto num = src.m_locks;
         while (num > 0) {
             unlock_shared(true);
             --num;
         }
     }
 
-    bool internal_lock(bool block, double secs) {
+    bool lock(const HiWait &wait) {
+        if (!acquire(wait))
+            return false;
+        m_is_ex = true;
+        return true;
+    }
+
+    // lock steps take a node's lock first, and count it under the gate once the rest of the step is in too
+    // see lock_step in hilok.cpp, until then a rename doesn't see it
+    bool acquire(const HiWait &wait) {
+        for (;;) {
+            if (!lock_exclusive(wait))
+                return false;
+            // an upgrade let go of its shared lock, the node isn't ours to take
+            if (!(m_update.load(std::memory_order_acquire) & HiUpdate::UPGRADING))
+                return true;
+            drop();
+            if (!HiUpdate::wait_upgraded(m_update, wait))
+                return false;
+        }
+    }
+
+    void count_exclusive() {
+        m_is_ex = true;
+    }
+
+    void drop() {
+        m_mut.unlock();
+        end_write();
+    }
+
+    // never a fast reader's lock, the slot would only be counted once migrated
+    bool acquire_shared(const HiWait &wait) {
+        if (!wait.m_block)
+            return m_mut.try_lock_shared();
+        if (wait.m_timed)
+            return m_mut.try_lock_shared_until(wait.m_deadline);
+        m_mut.lock_shared();
+        return true;
+    }
+
+    void count_shared() {
+        ++m_num_r;
+        maybe_bias();
+    }
+
+    void drop_shared() {
+        m_mut.unlock_shared();
+    }
+
+private:
+    bool lock_exclusive(const HiWait &wait) {
         bool ret;
-        if (!block) {
-            ret = mut_op(try_lock);
-        } else if (secs != 0.0) {
-            ret = mut_op_1(try_lock_for, std::chrono::duration<double>(secs));
+        begin_write();
+        if (!wait.m_block) {
+            ret = m_mut.try_lock();
+        } else if (wait.m_timed) {
+            ret = m_mut.try_lock_until(wait.m_deadline);
         } else {
-            mut_op(lock);
+            m_mut.lock();
             ret = true;
         }
+        if (!ret)
+            end_write();
         return ret;
     }
- 
-    bool lock(bool block, double secs) {
-        bool ret = internal_lock(block, secs);
-        if (ret)
-            m_is_ex = true;
-        return ret;
-    }
- 
+
+public:
     void lock() {
-        mut_op(lock);
+        begin_write();
+        m_mut.lock();
         m_is_ex = true;
     }
 
     bool try_lock() {
-        if (mut_op(try_lock)) {
+        begin_write();
+        if (m_mut.try_lock()) {
             m_is_ex = true;
             return true;
         }
+        end_write();
         return false;
     }
 
+    // an erase probe revokes the bias like any writer, or an idle biased node would never go
+    // the bias only comes back after bias_threshold slow reads, so that's the most it costs a hot node
     bool try_solo_lock() {
-        if (is_recursive() ? m_r_mut.try_solo_lock() : m_t_mut.try_lock()) {
+        begin_write();
+        bool ret;
+        if constexpr (Policy::recursive)
+            ret = m_mut.try_solo_lock();
+        else
+            ret = m_mut.try_lock();
+        if (ret) {
             m_is_ex = true;
             return true;
         }
+        end_write();
         return false;
     }
 
 
     bool try_lock_for(double secs) {
-        if (mut_op_1(try_lock_for, std::chrono::duration<double>(secs))) {
+        begin_write();
+        if (m_mut.try_lock_for(std::chrono::duration<double>(secs))) {
             m_is_ex = true;
             return true;
         }
+        end_write();
         return false;
     }
 
     void unlock() {
         m_is_ex = false;
-        mut_op(unlock);
+        m_mut.unlock();
+        end_write();
     }
 
+    // unlock on behalf of tid
     void unlock(std::thread::id tid) {
-        assert(is_recursive());
-        m_r_mut.unlock(tid);
-        --m_num_r;
+        if constexpr (Policy::recursive) {
+            m_mut.unlock(tid);
+        } else {
+            // a plain shared mutex can only be write-unlocked by its owner
+            if (tid != std::this_thread::get_id())
+                throw HiErr("Calling exclusively unlock from the wrong thread");
+            m_mut.unlock();
+        }
+        m_is_ex = false;
+        end_write();
     }
    
     void lock_shared() {
-        mut_op(lock_shared);
+        if (fast_lock_shared())
+            return;
+        m_mut.lock_shared();
         ++m_num_r;
+        maybe_bias();
     }
 
-    bool lock_shared(bool block, double secs) {
+    bool lock_shared(const HiWait &wait) {
+        if (fast_lock_shared())
+            return true;
         bool ret;
-        if (!block) {
-            ret = mut_op(try_lock_shared);
-        } else if (secs != 0.0) {
-            ret = mut_op_1(try_lock_shared_for, std::chrono::duration<double>(secs));
+        if (!wait.m_block) {
+            ret = m_mut.try_lock_shared();
+        } else if (wait.m_timed) {
+            ret = m_mut.try_lock_shared_until(wait.m_deadline);
         } else {
-            mut_op(lock_shared);
+            m_mut.lock_shared();
             ret = true;
         }
-        if (ret)
+        if (ret) {
             ++m_num_r;
+            maybe_bias();
+        }
         return ret;
     }
  
     bool try_lock_shared() {
-        auto ret = mut_op(try_lock_shared);
-        if (ret)
+        if (fast_lock_shared())
+            return true;
+        auto ret = m_mut.try_lock_shared();
+        if (ret) {
             ++m_num_r;
+            maybe_bias();
+        }
         return ret;
     }
 
     bool try_lock_shared_for(double secs) {
-        auto ret = mut_op_1(try_lock_shared_for, std::chrono::duration<double>(secs));
-        if (ret)
+        if (fast_lock_shared())
+            return true;
+        auto ret = m_mut.try_lock_shared_for(std::chrono::duration<double>(secs));
+        if (ret) {
             ++m_num_r;
+            maybe_bias();
+        }
         return ret;
     }
 
     void unlock_shared(bool any_thread = 0) {
-        if(is_recursive() && any_thread) {
-            m_r_mut.unlock_any_shared();
+        if (fast_unlock_shared(std::this_thread::get_id()))
+            return;
+        if constexpr (Policy::recursive) {
+            if (any_thread) {
+                // the lock we release may belong to a fast reader
+                revoke_bias();
+                m_mut.unlock_any_shared();
+            } else {
+                m_mut.unlock_shared();
+            }
         } else {
-            mut_op(unlock_shared);
+            m_mut.unlock_shared();
         }
         --m_num_r;
     }
 
     void unlock_shared(std::thread::id tid) {
-        assert(is_recursive());
-        m_r_mut.unlock_shared(tid);
+        if (fast_unlock_shared(tid))
+            return;
+        if constexpr (Policy::recursive)
+            m_mut.unlock_shared(tid);
+        else
+            m_mut.unlock_shared();  // shared owners aren't tracked per thread
         --m_num_r;
     }
+
+    // readers only touch their own slot while the bias is on
+    bool fast_lock_shared() {
+        if constexpr (!Policy::read_biased) {
+            return false;
+        } else {
+            if (!(this->m_bias.load(std::memory_order_relaxed) & this->BIAS_ON))
+                return false;
+            auto tid = std::this_thread::get_id();
+            auto &slot = HiBiasTable::slot(this, tid);
+            uintptr_t expected = 0;
+            if (!slot.m_lock.compare_exchange_strong(expected, HiBiasTable::BUSY, std::memory_order_acquire))
+                return false;
+            slot.m_tid = tid;
+            slot.m_lock.store(reinterpret_cast<uintptr_t>(this));
+            if (this->m_bias.load() & this->BIAS_ON)
+                return true;
+            // raced with a revocation: back out, unless the writer already migrated us into the real lock
+            expected = reinterpret_cast<uintptr_t>(this);
+            if (slot.m_lock.compare_exchange_strong(expected, HiBiasTable::BUSY, std::memory_order_acquire)) {
+                slot.m_lock.store(0, std::memory_order_release);
+                return false;
+            }
+            return true;
+        }
+    }
+
+    bool fast_unlock_shared(std::thread::id tid) {
+        if constexpr (!Policy::read_biased) {
+            (void)tid;
+            return false;
+        } else {
+            auto &slot = HiBiasTable::slot(this, tid);
+            auto self = reinterpret_cast<uintptr_t>(this);
+            while (true) {
+                auto cur = slot.m_lock.load(std::memory_order_acquire);
+                if (cur == HiBiasTable::BUSY) {
+                    std::this_thread::yield();
+                    continue;
+                }
+                if (cur != self)
+                    return false;
+                if (!slot.m_lock.compare_exchange_weak(cur, HiBiasTable::BUSY, std::memory_order_acquire))
+                    continue;
+                if (slot.m_tid == tid) {
+                    slot.m_lock.store(0, std::memory_order_release);
+                    return true;
+                }
+                // another thread's slot for this mutex (hash collision), it's not ours to release
+                slot.m_lock.store(self, std::memory_order_release);
+                return false;
+            }
+        }
+    }
+
+    // turn off the bias and move every fast reader into the real lock, so it can see them
+    void revoke_bias() {
+        if constexpr (Policy::read_biased) {
+            uint32_t cur = this->m_bias;
+            while (true) {
+                if (cur & this->BIAS_SCANNING) {
+                    // someone else is migrating, wait until they are done
+                    std::this_thread::yield();
+                    cur = this->m_bias;
+                    continue;
+                }
+                if (!(cur & this->BIAS_ON))
+                    return;
+                if (this->m_bias.compare_exchange_weak(cur, (cur & ~this->BIAS_ON) | this->BIAS_SCANNING))
+                    break;
+            }
+            auto self = reinterpret_cast<uintptr_t>(this);
+            for (auto &slot : HiBiasTable::slots) {
+                while (true) {
+                    auto lk = slot.m_lock.load();
+                    if (lk == HiBiasTable::BUSY) {
+                        std::this_thread::yield();
+                        continue;
+                    }
+                    if (lk != self)
+                        break;
+                    if (!slot.m_lock.compare_exchange_weak(lk, HiBiasTable::BUSY, std::memory_order_acquire))
+                        continue;
+                    adopt_shared(slot.m_tid);
+                    slot.m_lock.store(0, std::memory_order_release);
+                    break;
+                }
+            }
+            this->m_bias_ticks = 0;
+            this->m_bias.fetch_and(~this->BIAS_SCANNING);
+        }
+    }
+
+private:
+    void adopt_shared(std::thread::id tid) {
+        // no writer can hold the lock while the bias was on, so this never blocks
+        if constexpr (Policy::recursive)
+            m_mut.adopt_shared(tid);
+        else
+            m_mut.lock_shared();
+        ++m_num_r;
+    }
+
+    void begin_write() {
+        if constexpr (Policy::read_biased) {
+            this->m_bias.fetch_add(this->BIAS_WRITER);
+            revoke_bias();
+        }
+    }
+
+    void end_write() {
+        if constexpr (Policy::read_biased)
+            this->m_bias.fetch_sub(this->BIAS_WRITER);
+    }
+
+    void maybe_bias() {
+        if constexpr (Policy::read_biased) {
+            if (this->m_bias.load(std::memory_order_relaxed) & this->BIAS_ON)
+                return;
+            if (++this->m_bias_ticks < this->bias_threshold)
+                return;
+            // only when idle of writers, which also means no writer can be holding the lock
+            uint32_t idle = 0;
+            if (this->m_bias.compare_exchange_strong(idle, this->BIAS_ON))
+                this->m_bias_ticks = 0;
+        }
+    }
 };
 
-class HiKeyNode {
+// runtime flags front end for a single mutex, forwards to the HiMutexT picked by the flags
+class HiMutex {
+public:
+    struct Impl {
+        virtual ~Impl() {}
+        virtual bool is_locked() = 0;
+        virtual bool is_recursive() = 0;
+        virtual int num_shared() = 0;
+        virtual void lock() = 0;
+        virtual bool try_lock() = 0;
+        virtual bool try_solo_lock() = 0;
+        virtual bool try_lock_for(double secs) = 0;
+        virtual void unlock() = 0;
+        virtual void unlock(std::thread::id tid) = 0;
+        virtual void lock_shared() = 0;
+        virtual bool try_lock_shared() = 0;
+        virtual bool try_lock_shared_for(double secs) = 0;
+        virtual void unlock_shared(bool any_thread) = 0;
+        virtual void unlock_shared(std::thread::id tid) = 0;
+    };
+
+    HiMutex(int rec_flags);
+    HiMutex(bool) = delete;
+
+    bool is_locked() { return m_impl->is_locked(); }
+    bool is_recursive() { return m_impl->is_recursive(); }
+    int num_shared() { return m_impl->num_shared(); }
+    void lock() { m_impl->lock(); }
+    bool try_lock() { return m_impl->try_lock(); }
+    bool try_solo_lock() { return m_impl->try_solo_lock(); }
+    bool try_lock_for(double secs) { return m_impl->try_lock_for(secs); }
+    void unlock() { m_impl->unlock(); }
+    void unlock(std::thread::id tid) { m_impl->unlock(tid); }
+    void lock_shared() { m_impl->lock_shared(); }
+    bool try_lock_shared() { return m_impl->try_lock_shared(); }
+    bool try_lock_shared_for(double secs) { return m_impl->try_lock_shared_for(secs); }
+    void unlock_shared(bool any_thread = 0) { m_impl->unlock_shared(any_thread); }
+    void unlock_shared(std::thread::id tid) { m_impl->unlock_shared(tid); }
+
+private:
+    std::unique_ptr<Impl> m_impl;
+};
+
+// child table key: the name, hashed once when the key is made
+// keys in a table view the child's own m_name, lookup keys view the caller's path, so neither copies the name
+struct HiNodeKey {
+    std::string_view m_name;
+    size_t m_hash;
+
+    HiNodeKey() : m_hash(0) {
+    }
+
+    explicit HiNodeKey(std::string_view name) : m_name(name), m_hash(std::hash<std::string_view>()(name)) {
+    }
+
+    bool operator == (const HiNodeKey &other) const {
+        return m_hash == other.m_hash && m_name == other.m_name;
+    }
+
+    bool operator != (const HiNodeKey &other) const {
+        return !(*this == other);
+    }
+
+    struct hasher {
+        size_t operator() (const HiNodeKey &key) const noexcept {
+            return key.m_hash;
+        }
+    };
+};
+
+// the children of one node, or of the root
+// guarded by a small reader/writer spin lock: lookups share it, inserts and erases take it alone
+// the lock and map are only allocated with the first child, a leaf pays one pointer
+template <class Node>
+class HiChildTable {
+public:
+    typedef HiNodeRef<Node> ref_type;
+    typedef std::unordered_map<HiNodeKey, ref_type, HiNodeKey::hasher> map_type;
+
+    HiChildTable() : m_body(nullptr) {
+    }
+
+    HiChildTable(const HiChildTable &) = delete;
+    HiChildTable & operator= (const HiChildTable &) = delete;
+
+    ~HiChildTable() {
+        delete m_body.load(std::memory_order_relaxed);
+    }
+
+    // false if there has never been a child, then there's nothing to find and nothing to unlock
+    bool lock_shared() {
+        Body *body = m_body.load(std::memory_order_acquire);
+        if (!body)
+            return false;
+        for (int spins = 0; ; backoff(spins)) {
+            uint32_t s = body->m_lock.load(std::memory_order_relaxed);
+            if (!(s & WRITER) && body->m_lock.compare_exchange_weak(s, s + READER, std::memory_order_acquire, std::memory_order_relaxed))
+                return true;
+        }
+    }
+
+    void unlock_shared() {
+        m_body.load(std::memory_order_relaxed)->m_lock.fetch_sub(READER, std::memory_order_release);
+    }
+
+    void lock() {
+        Body *body = m_body.load(std::memory_order_acquire);
+        if (!body) {
+            // several lockers of the parent may be adding its first children at once
+            Body *fresh = new Body();
+            if (m_body.compare_exchange_strong(body, fresh, std::memory_order_acq_rel, std::memory_order_acquire))
+                body = fresh;
+            else
+                delete fresh;
+        }
+        // claim the writer bit first, so new readers stop coming in, then wait for the old ones to leave
+        for (int spins = 0; ; backoff(spins)) {
+            uint32_t s = body->m_lock.load(std::memory_order_relaxed);
+            if (!(s & WRITER) && body->m_lock.compare_exchange_weak(s, s | WRITER, std::memory_order_acquire, std::memory_order_relaxed))
+                break;
+        }
+        for (int spins = 0; body->m_lock.load(std::memory_order_acquire) != WRITER; backoff(spins)) {
+        }
+    }
+
+    void unlock() {
+        m_body.load(std::memory_order_relaxed)->m_lock.fetch_sub(WRITER, std::memory_order_release);
+    }
+
+    // the rest need the lock, shared for lookups
+
+    Node *find(const HiNodeKey &key) const {
+        Body *body = m_body.load(std::memory_order_relaxed);
+        if (!body)
+            return nullptr;
+        auto it = body->m_map.find(key);
+        return it == body->m_map.end() ? nullptr : it->second.get();
+    }
+
+    // keyed by the node's own key(), which must not change while it's in the table
+    // replaces any other node with the same name, whose ref is returned
+    ref_type insert(const ref_type &node) {
+        auto &map = m_body.load(std::memory_order_relaxed)->m_map;
+        ref_type old;
+        auto res = map.emplace(node->key(), node);
+        if (!res.second) {
+            old = std::move(res.first->second);
+            map.erase(res.first);
+            map.emplace(node->key(), node);
+        } else {
+            m_body.load(std::memory_order_relaxed)->m_count.fetch_add(1, std::memory_order_relaxed);
+        }
+        return old;
+    }
+
+    // takes node out, if it's there, and hands back the table's ref
+    // the caller should drop it after unlocking, it may be the last one
+    ref_type take(Node *node) {
+        ref_type ret;
+        Body *body = m_body.load(std::memory_order_relaxed);
+        if (!body)
+            return ret;
+        auto it = body->m_map.find(node->key());
+        if (it != body->m_map.end() && it->second.get() == node) {
+            ret = std::move(it->second);
+            body->m_map.erase(it);
+            body->m_count.fetch_sub(1, std::memory_order_relaxed);
+        }
+        return ret;
+    }
+
+    template <class F>
+    void for_each(F f) const {
+        if (Body *body = m_body.load(std::memory_order_relaxed))
+            for (auto &it : body->m_map)
+                f(it.second);
+    }
+
+    // drops every ref in this table and, first, in the tables below it
+    // children hold their parents, so a table that still has nodes at teardown would otherwise never be freed
+    void clear() {
+        Body *body = m_body.exchange(nullptr, std::memory_order_acq_rel);
+        if (!body)
+            return;
+        for (auto &it : body->m_map)
+            it.second->m_children.clear();
+        delete body;
+    }
+
+    // readable without the lock
+    size_t size() const {
+        Body *body = m_body.load(std::memory_order_acquire);
+        return body ? body->m_count.load(std::memory_order_acquire) : 0;
+    }
+
+private:
+    static const uint32_t WRITER = 1;
+    static const uint32_t READER = 2;
+
+    struct Body {
+        std::atomic<uint32_t> m_lock{0};
+        std::atomic<uint32_t> m_count{0};
+        map_type m_map;
+    };
+
+    static void backoff(int &spins) {
+        if (++spins > 64)
+            std::this_thread::yield();
+    }
+
+    std::atomic<Body *> m_body;
+};
+
+// one path component, found through its parent's m_children
+// there can be millions of these, an idle node is about 100 bytes, allocated from its manager's pool
+template <class Policy>
+class HiKeyNodeT {
 public:
-    std::pair<std::shared_ptr<HiKeyNode>, std::string> m_key;
-    HiMutex m_mut;
+    typedef HiNodeRef<HiKeyNodeT> ref_type;
+    typedef HiNodeKey key_type;
+
+    ref_type m_parent;              // empty at the root
+    HiName m_name;
+    std::atomic<uint32_t> m_refs;
     std::atomic<int> m_inref;
-    HiKeyNode(std::pair<std::shared_ptr<HiKeyNode>, std::string> key, int flags) : m_key(key), m_mut(flags), m_inref(0) {
+    HiChildTable<HiKeyNodeT> m_children;
+    HiMutexT<Policy> m_mut;
+
+    HiKeyNodeT(const ref_type &parent, std::string_view name, HiNameTable *names = nullptr) : m_parent(parent), m_name(name, names), m_refs(0), m_inref(0) {
+    }
+
+    // views m_name, only valid until the name changes
+    key_type key() const {
+        return key_type(m_name.view());
+    }
+
+    void add_ref() {
+        m_refs.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // true when that was the last reference
+    bool release_ref() {
+        return m_refs.fetch_sub(1, std::memory_order_acq_rel) == 1;
     }
-    HiKeyNode(std::pair<std::shared_ptr<HiKeyNode>, std::string>, bool) = delete;
 };
 
-class HiLok;
+template <class Policy>
+class HiLokT;
 
+template <class Policy>
+class HiPreparedT;
+
+// a held lock, release() is safe to call more than once
 class HiHandle {
-    bool m_shared;
-    std::shared_ptr<HiKeyNode> m_ref;
-    std::shared_ptr<HiLok> m_mgr;
-    bool m_released;
+public:
+    virtual ~HiHandle() {
+    }
+
+    virtual void release() = 0;
+
+    // locks relpath below this handle's node, relying on the locks this handle already holds on the way there
+    // only the nodes below are locked and released by the new handle, keep this one until it's released
+    virtual std::shared_ptr<HiHandle> read_child(std::string_view relpath, bool block = true, double timeout = 0) = 0;
+    virtual std::shared_ptr<HiHandle> write_child(std::string_view relpath, bool block = true, double timeout = 0) = 0;
+
+    // turns an UPDATE lock into a WRITE lock, without letting another writer in
+    // on failure it's still held UPDATE
+    virtual void upgrade(bool block = true, double timeout = 0) = 0;
+};
+
+// a path resolved once, for locking many times
+// its nodes stay in the trie until it and every handle locked through it are gone
+class HiPrepared {
+public:
+    virtual ~HiPrepared() {
+    }
+
+    virtual std::shared_ptr<HiHandle> read(bool block = true, double timeout = 0) = 0;
+    virtual std::shared_ptr<HiHandle> write(bool block = true, double timeout = 0) = 0;
+};
+
+// a held lock as a move-only value, like std::unique_lock
+// nothing is allocated, and the manager isn't counted, the caller keeps it alive until the lock is released
+template <class Policy>
+class HiLockT {
+public:
+    typedef HiKeyNodeT<typename Policy::mutex_policy> node_type;
+    typedef typename node_type::ref_type node_ref;
+
+private:
+    HiLokT<Policy> *m_mgr;
+    node_ref m_ref;
+    node_ref m_base;    // held by another lock, ours start below it
+    node_ref m_cover;   // for modes that intend to write, where our intents above m_base stop, null for the root
     std::thread::id m_src_thread;
+    HiMode m_mode;
+    bool m_held;
 
 public:
-    HiHandle(std::shared_ptr<HiLok> mgr, bool shared, std::shared_ptr<HiKeyNode> ref) :
-        m_shared(shared), m_ref(ref), m_mgr(mgr), m_released(false), m_src_thread(std::this_thread::get_id()) {
+    HiLockT() : m_mgr(nullptr), m_mode(HiMode::READ), m_held(false) {
     }
 
-    HiHandle ( HiHandle && ) = default;
-    HiHandle &  operator= ( HiHandle && ) = default;
-    HiHandle ( const HiHandle & ) = delete;
-    HiHandle & operator= ( const HiHandle & ) = delete;
+    HiLockT(HiLokT<Policy> *mgr, HiMode mode, node_ref ref, node_ref base = node_ref(), node_ref cover = node_ref()) :
+        m_mgr(mgr), m_ref(std::move(ref)), m_base(std::move(base)), m_cover(std::move(cover)), m_src_thread(std::this_thread::get_id()), m_mode(mode), m_held(true) {
+    }
 
-    virtual ~HiHandle() {
+    HiLockT(HiLockT &&other) noexcept :
+        m_mgr(other.m_mgr), m_ref(std::move(other.m_ref)), m_base(std::move(other.m_base)), m_cover(std::move(other.m_cover)), m_src_thread(other.m_src_thread), m_mode(other.m_mode), m_held(other.m_held) {
+        other.m_held = false;
+    }
+
+    HiLockT & operator= (HiLockT &&other) {
+        if (this != &other) {
+            release();
+            m_mgr = other.m_mgr;
+            m_ref = std::move(other.m_ref);
+            m_base = std::move(other.m_base);
+            m_cover = std::move(other.m_cover);
+            m_src_thread = other.m_src_thread;
+            m_mode = other.m_mode;
+            m_held = other.m_held;
+            other.m_held = false;
+        }
+        return *this;
+    }
+
+    HiLockT ( const HiLockT & ) = delete;
+    HiLockT & operator= ( const HiLockT & ) = delete;
+
+    ~HiLockT() {
         try {
             release();
         } catch (HiErr &) {
         }
     }
 
+    // safe to call more than once
     void release();
+
+    // locks relpath below this lock's node, see HiHandle::read_child
+    // a READ_TREE lock can't write below itself, its holder would wait for itself, lock SIX for that
+    HiLockT lock_child(std::string_view relpath, HiMode mode, const HiWait &wait) const;
+
+    HiLockT read_child(std::string_view relpath, const HiWait &wait) const {
+        return lock_child(relpath, HiMode::READ, wait);
+    }
+
+    HiLockT write_child(std::string_view relpath, const HiWait &wait) const {
+        return lock_child(relpath, HiMode::WRITE, wait);
+    }
+
+    HiLockT read_child(std::string_view relpath, bool block = true, double timeout = 0) const {
+        return read_child(relpath, HiWait(block, timeout));
+    }
+
+    HiLockT write_child(std::string_view relpath, bool block = true, double timeout = 0) const {
+        return write_child(relpath, HiWait(block, timeout));
+    }
+
+    // see HiHandle::upgrade, from the thread that locked it
+    void upgrade(const HiWait &wait = HiWait());
+
+    void upgrade(bool block, double timeout = 0) {
+        upgrade(HiWait(block, timeout));
+    }
+
+    bool owns_lock() const {
+        return m_held;
+    }
+
+    explicit operator bool() const {
+        return m_held;
+    }
+
+    bool is_shared() const {
+        return m_mode != HiMode::WRITE;
+    }
+
+    HiMode mode() const {
+        return m_mode;
+    }
+
+    // the locked node, null for the root
+    node_type *leaf() const {
+        return m_ref.get();
+    }
 };
 
-struct pair_hash
-{
-    template <class T1, class T2>
-    std::size_t operator() (const std::pair<T1, T2> &pair) const {
-        return std::hash<T1>()(pair.first) ^ std::hash<T2>()(pair.second);
+// shared handle for the runtime API and python, a HiLockT that keeps its manager alive
+template <class Policy>
+class HiHandleT : public HiHandle {
+public:
+    typedef HiKeyNodeT<typename Policy::mutex_policy> node_type;
+    typedef typename node_type::ref_type node_ref;
+    typedef HiLockT<Policy> lock_type;
+
+private:
+    std::shared_ptr<HiLokT<Policy>> m_mgr;
+    lock_type m_lock;       // released before the manager goes
+
+public:
+    HiHandleT(std::shared_ptr<HiLokT<Policy>> mgr, lock_type lock) :
+        m_mgr(std::move(mgr)), m_lock(std::move(lock)) {
+    }
+
+    HiHandleT ( const HiHandleT & ) = delete;
+    HiHandleT & operator= ( const HiHandleT & ) = delete;
+
+    ~HiHandleT() override {
+        try {
+            release();
+        } catch (HiErr &) {
+        }
+    }
+
+    void release() override {
+        m_lock.release();
+    }
+
+    std::shared_ptr<HiHandle> read_child(std::string_view relpath, bool block = true, double timeout = 0) override {
+        return std::make_shared<HiHandleT>(m_mgr, m_lock.read_child(relpath, block, timeout));
+    }
+
+    std::shared_ptr<HiHandle> write_child(std::string_view relpath, bool block = true, double timeout = 0) override {
+        return std::make_shared<HiHandleT>(m_mgr, m_lock.write_child(relpath, block, timeout));
+    }
+
+    void upgrade(bool block = true, double timeout = 0) override {
+        m_lock.upgrade(block, timeout);
+    }
+
+    // the locked node, null for the root
+    node_type *leaf() const {
+        return m_lock.leaf();
     }
 };
 
+// the locks of a lock_many call, in tree order, each one a root lock or a child of an earlier one
+// released in reverse, so children go first
+template <class Policy>
+class HiMultiHandleT : public HiHandle {
+public:
+    typedef HiLockT<Policy> lock_type;
+
+private:
+    std::shared_ptr<HiLokT<Policy>> m_mgr;
 
-class HiLok {
 public:
-    std::unordered_map<std::pair<std::shared_ptr<HiKeyNode>, std::string>, std::shared_ptr<HiKeyNode>, pair_hash> m_map;
-    std::mutex m_mutex;
+    std::vector<lock_type> m_locks;    // released before the manager goes
+
+    explicit HiMultiHandleT(std::shared_ptr<HiLokT<Policy>> mgr) : m_mgr(std::move(mgr)) {
+    }
+
+    HiMultiHandleT ( const HiMultiHandleT & ) = delete;
+    HiMultiHandleT & operator= ( const HiMultiHandleT & ) = delete;
+
+    ~HiMultiHandleT() override {
+        try {
+            release();
+        } catch (HiErr &) {
+        }
+    }
+
+    void release() override {
+        for (auto it = m_locks.rbegin(); it != m_locks.rend(); ++it)
+            it->release();
+    }
+
+    // there's no one node to lock below
+    std::shared_ptr<HiHandle> read_child(std::string_view, bool = true, double = 0) override {
+        throw HiErr("a lock_many handle has no child locks");
+    }
+
+    std::shared_ptr<HiHandle> write_child(std::string_view, bool = true, double = 0) override {
+        throw HiErr("a lock_many handle has no child locks");
+    }
+
+    void upgrade(bool = true, double = 0) override {
+        throw HiErr("only an UPDATE lock can be upgraded");
+    }
+};
+
+// node trie and the operations that only depend on how node mutexes behave
+// shared by every HiLokT that only differs in unlock looseness
+template <class MutexPolicy>
+class HiLokCore {
+public:
+    typedef HiKeyNodeT<MutexPolicy> node_type;
+    typedef typename node_type::key_type key_type;
+    typedef typename node_type::ref_type node_ref;
+    typedef HiChildTable<node_type> table_type;
+
+    std::unique_ptr<HiNameTable> m_names;   // null unless interning, outlives the nodes
+    HiNodePool<node_type> m_pool;           // outlives the nodes
+    table_type m_root;
+    recursive_shared_mutex m_rename_mutex;  // renames hold several tables, one at a time keeps them from deadlocking
+    std::atomic<size_t> m_size;
+    std::atomic<uint64_t> m_generation;     // bumped when a rename starts and ends, cached chains from before are stale
+    bool m_cache_paths;
     char m_sep;
-    int m_flags;
-    std::shared_ptr<HiKeyNode> _get_node(const std::pair<std::shared_ptr<HiKeyNode>, std::string> &key);
 
+    // idle nodes kept in the trie, sharded by node address
+    // m_last has the latest release of each, older queue entries for a node are stale
+    struct alignas(64) RetainShard {
+        std::mutex m_mutex;
+        std::deque<std::pair<node_ref, uint64_t>> m_queue;
+        std::unordered_map<node_type *, uint64_t> m_last;
+        uint64_t m_seq = 0;
+    };
+
+    static const size_t num_retain_shards = 16;
+    std::atomic<size_t> m_retain_max;       // per shard, 0 erases idle nodes right away
+    std::array<RetainShard, num_retain_shards> m_retained;      // holds refs, so it comes after the pool
+
+    RetainShard &retain_shard(node_type *ref) {
+        return m_retained[(reinterpret_cast<uintptr_t>(ref) * 0x9E3779B97F4A7C15ULL) >> 60];
+    }
+
+    // idle nodes waiting for a batch erase, sharded by releasing thread
+    struct alignas(64) RetireShard {
+        std::mutex m_mutex;
+        std::vector<node_ref> m_nodes;
+    };
+
+    static const size_t num_retire_shards = 16;
+    static const size_t retire_batch = 64;
+    bool m_defer_erase;
+    std::array<RetireShard, num_retire_shards> m_retired;     // holds refs, so it comes after the pool
+
+    RetireShard &retire_shard() {
+        return m_retired[std::hash<std::thread::id>()(std::this_thread::get_id()) % num_retire_shards];
+    }
+
+    table_type &children(node_type *parent) {
+        return parent ? parent->m_children : m_root;
+    }
+
+    node_ref _get_node(node_type *parent, std::string_view name);
+
+public:
+
+    // options are the runtime HiFlags, INTERN_NAMES, CACHE_PATHS and DEFER_ERASE
+    HiLokCore(char sep, int options = 0) :
+        m_names((options & HiFlags::INTERN_NAMES) ? new HiNameTable() : nullptr), m_size(0), m_generation(0),
+        m_cache_paths((options & HiFlags::CACHE_PATHS) != 0), m_sep(sep), m_retain_max(0),
+        m_defer_erase((options & HiFlags::DEFER_ERASE) != 0) {
+    }
+
+    ~HiLokCore() {
+        m_root.clear();
+    }
+
+    static constexpr bool is_recursive() {return MutexPolicy::recursive;}
+
+    node_ref find_node(std::string_view path_from);
+
+    void rename(std::string_view from, std::string_view to, const HiWait &wait) {
+        rename_many({{from, to}}, wait);
+    }
+
+    void rename(std::string_view from, std::string_view to, bool block = true, double timeout = 0) {
+        rename(from, to, HiWait(block, timeout));
+    }
+
+    // moves every from path to its to path in one commit, or moves none of them
+    // no path may be another move's source or destination, or below one
+    void rename_many(const std::vector<std::pair<std::string_view, std::string_view>> &moves, const HiWait &wait);
+
+    // removes ref from parent's table if nobody is using it, caller keeps both alive
+    // false if ref is still there, so parent can't be erased either
+    bool erase_safe(node_type *ref, node_type *parent);
+    // called by releasers once they're done with ref, erases it, or keeps it around if idle nodes are retained
+    // false if ref is still there
+    bool idle(node_type *ref, node_type *parent);
+    // resolves and pins path, root first, for a path cache or a prepared path
+    std::vector<node_type *> pin(std::string_view path);
+    // drops a pinned chain
+    void unpin(const std::vector<node_type *> &chain);
+    // caller holds the parent's table, and drops the returned ref after unlocking it
+    node_ref erase_unsafe(node_type *ref);
+
+    template <class F>
+    void for_each_node(F f) {
+        for_each_in(nullptr, f);
+    }
+
+    size_t size() { return m_size.load(std::memory_order_acquire); };
+
+    // keep about max idle nodes in the trie instead of erasing them, the least recently released go first
+    void set_idle_retention(size_t max);
+
+    // with DEFER_ERASE, erases the idle nodes still waiting for a batch
+    void reclaim();
+    // with DEFER_ERASE, erases this thread's retired nodes once there's a batch of them
+    // releasers call it when they're done, so their own locks don't keep the parents around
+    void collect();
+
+private:
+    void retain(node_type *ref);
+    node_ref pop_oldest(RetainShard &sh);
+    void evict(node_ref victim);
+    void retire(node_type *ref);
+
+    template <class F>
+    void for_each_in(node_type *parent, F &f) {
+        auto &table = children(parent);
+        if (!table.lock_shared())
+            return;
+        try {
+            table.for_each([&](const node_ref &node) {
+                f(parent, node->m_name.view(), node.get());
+                for_each_in(node.get(), f);
+            });
+        } catch (...) {
+            table.unlock_shared();
+            throw;
+        }
+        table.unlock_shared();
+    }
+};
+
+// lock manager with its flags fixed at compile time
+// instantiated in hilok.cpp for every HiPolicy
+template <class Policy>
+class HiLokT : public HiLokCore<typename Policy::mutex_policy> {
 public:
+    typedef HiLokCore<typename Policy::mutex_policy> core_type;
+    typedef typename core_type::node_type node_type;
+    typedef typename core_type::key_type key_type;
+    typedef typename core_type::node_ref node_ref;
+    typedef HiHandleT<Policy> handle_type;
+    typedef HiMultiHandleT<Policy> multi_handle_type;
+    typedef HiLockT<Policy> lock_type;
+
+    HiLokT(char sep = '/', int options = 0) : core_type(sep, options) {
+    }
+
+    static constexpr int flags = Policy::flags;
+
+    // mgr keeps the manager alive for as long as the handle
+    // the wait covers the whole path, not each node on it
+    std::shared_ptr<handle_type> read(std::shared_ptr<HiLokT> mgr, std::string_view path, const HiWait &wait);
+
+    std::shared_ptr<handle_type> write(std::shared_ptr<HiLokT> mgr, std::string_view path, const HiWait &wait);
+
+    std::shared_ptr<handle_type> read(std::shared_ptr<HiLokT> mgr, std::string_view path, bool block = true, double timeout = 0) {
+        return read(std::move(mgr), path, HiWait(block, timeout));
+    }
+
+    std::shared_ptr<handle_type> write(std::shared_ptr<HiLokT> mgr, std::string_view path, bool block = true, double timeout = 0) {
+        return write(std::move(mgr), path, HiWait(block, timeout));
+    }
+
+    // forgets this thread's cached paths for this manager, so their nodes can go
+    void flush_path_cache();
+
+    // allocation free locks for C++ callers, they don't use the path cache
+    lock_type read_lock(std::string_view path, const HiWait &wait = HiWait()) {
+        return lock_below(node_ref(), path, HiMode::READ, wait);
+    }
+
+    lock_type write_lock(std::string_view path, const HiWait &wait = HiWait()) {
+        return lock_below(node_ref(), path, HiMode::WRITE, wait);
+    }
+
+    lock_type update_lock(std::string_view path, const HiWait &wait = HiWait()) {
+        return lock_below(node_ref(), path, HiMode::UPDATE, wait);
+    }
+
+    lock_type read_lock(std::string_view path, bool block, double timeout = 0) {
+        return read_lock(path, HiWait(block, timeout));
+    }
+
+    lock_type write_lock(std::string_view path, bool block, double timeout = 0) {
+        return write_lock(path, HiWait(block, timeout));
+    }
 
-    HiLok(char sep = '/', int flags=HiFlags::RECURSIVE) : m_sep(sep), m_flags(flags) {
+    lock_type update_lock(std::string_view path, bool block, double timeout = 0) {
+        return update_lock(path, HiWait(block, timeout));
     }
+
+    // any mode, READ and WRITE are read and write
+    std::shared_ptr<handle_type> lock(std::shared_ptr<HiLokT> mgr, std::string_view path, HiMode mode, const HiWait &wait);
+
+    std::shared_ptr<handle_type> lock(std::shared_ptr<HiLokT> mgr, std::string_view path, HiMode mode, bool block = true, double timeout = 0) {
+        return lock(std::move(mgr), path, mode, HiWait(block, timeout));
+    }
+
+    // locks path below base, which the caller already holds
+    // for modes that intend to write, intents are also taken from base up to cover, which the caller holds WRITE or SIX, or to the root
+    lock_type lock_below(node_ref base, std::string_view path, HiMode mode, const HiWait &wait = HiWait(), node_ref cover = node_ref());
+
+    // locks several paths, all of them or none, in tree order, so lock_many calls can't deadlock each other
+    // a node shared by several paths is locked once, requests for the same path merge, the stronger mode wins
+    // a READ_TREE path with writes or updates below it in the same call becomes SIX
+    std::shared_ptr<multi_handle_type> lock_many(std::shared_ptr<HiLokT> mgr, const std::vector<std::pair<std::string_view, HiMode>> &paths, const HiWait &wait = HiWait());
+
+    // resolves path now, creating its nodes, so locking it later only takes the node mutexes
+    std::shared_ptr<HiPreparedT<Policy>> prepare(std::shared_ptr<HiLokT> mgr, std::string_view path);
+
+private:
+    std::shared_ptr<handle_type> lock_cached(const std::shared_ptr<HiLokT> &mgr, std::string_view path, bool shared, const HiWait &wait);
+    void cache_path(const std::shared_ptr<HiLokT> &mgr, std::string_view path, uint64_t generation, node_type *leaf);
+};
+
+template <class Policy>
+class HiPreparedT : public HiPrepared {
+public:
+    typedef HiLokT<Policy> lok_type;
+    typedef typename lok_type::node_type node_type;
+
+    // a resolved chain, root first, pinned until the prepared path and its handles let go of it
+    struct Pin {
+        std::shared_ptr<lok_type> m_mgr;
+        uint64_t m_generation;
+        std::vector<node_type *> m_chain;
+
+        ~Pin();
+    };
+
+    // a lock taken through a pin, releasing it only touches the node mutexes
+    class Handle : public HiHandle {
+        std::shared_ptr<Pin> m_pin;
+        bool m_shared;
+        bool m_released;
+        std::thread::id m_src_thread;
+
+    public:
+        Handle(std::shared_ptr<Pin> pin, bool shared) :
+            m_pin(std::move(pin)), m_shared(shared), m_released(false), m_src_thread(std::this_thread::get_id()) {
+        }
+
+        Handle ( const Handle & ) = delete;
+        Handle & operator= ( const Handle & ) = delete;
+
+        ~Handle() override {
+            try {
+                release();
+            } catch (HiErr &) {
+            }
+        }
+
+        void release() override;
+
+        std::shared_ptr<HiHandle> read_child(std::string_view relpath, bool block = true, double timeout = 0) override;
+        std::shared_ptr<HiHandle> write_child(std::string_view relpath, bool block = true, double timeout = 0) override;
+
+        void upgrade(bool = true, double = 0) override {
+            throw HiErr("only an UPDATE lock can be upgraded");
+        }
+    };
+
+    HiPreparedT(std::shared_ptr<lok_type> mgr, std::string_view path);
+
+    HiPreparedT ( const HiPreparedT & ) = delete;
+    HiPreparedT & operator= ( const HiPreparedT & ) = delete;
+
+    std::shared_ptr<HiHandle> read(bool block = true, double timeout = 0) override {
+        return lock(true, block, timeout);
+    }
+
+    std::shared_ptr<HiHandle> write(bool block = true, double timeout = 0) override {
+        return lock(false, block, timeout);
+    }
+
+private:
+    std::shared_ptr<HiHandle> lock(bool shared, bool block, double timeout);
+    std::shared_ptr<Pin> make_pin(const std::shared_ptr<lok_type> &mgr);
+
+    std::string m_path;
+    std::mutex m_mutex;             // guards m_pin, a rename makes us swap it for a fresh one
+    std::shared_ptr<Pin> m_pin;
+};
+
+// a node found by HiLok::find_node, whatever its manager's flags
+// it keeps the node's memory, but not its place in the trie, and it mustn't outlive the HiLok
+class HiKeyNode {
+public:
+    virtual ~HiKeyNode() {
+    }
+
+    virtual std::string name() const = 0;
+    virtual bool is_locked() = 0;
+    virtual int num_shared() = 0;
+    virtual std::shared_ptr<HiKeyNode> parent() = 0;    // null at the top
+};
+
+// runtime flags front end, forwards to the HiLokT instantiation picked by the flags
+class HiLok {
+public:
+    struct Impl {
+        virtual ~Impl() {}
+        virtual std::shared_ptr<HiKeyNode> find_node(std::string_view path) = 0;
+        virtual std::shared_ptr<HiHandle> read(const std::shared_ptr<HiLok> &mgr, std::string_view path, const HiWait &wait) = 0;
+        virtual std::shared_ptr<HiHandle> write(const std::shared_ptr<HiLok> &mgr, std::string_view path, const HiWait &wait) = 0;
+        virtual std::shared_ptr<HiHandle> lock(const std::shared_ptr<HiLok> &mgr, std::string_view path, HiMode mode, const HiWait &wait) = 0;
+        virtual void rename(std::string_view from, std::string_view to, const HiWait &wait) = 0;
+        virtual void rename_many(const std::vector<std::pair<std::string_view, std::string_view>> &moves, const HiWait &wait) = 0;
+        virtual std::shared_ptr<HiHandle> lock_many(const std::shared_ptr<HiLok> &mgr, const std::vector<std::pair<std::string_view, HiMode>> &paths, const HiWait &wait) = 0;
+        virtual size_t size() = 0;
+        virtual void for_each_node(const std::function<void(const void *parent, std::string_view name, const void *node)> &f) = 0;
+        virtual void flush_path_cache() = 0;
+        virtual void set_idle_retention(size_t max) = 0;
+        virtual void reclaim() = 0;
+        virtual std::shared_ptr<HiPrepared> prepare(const std::shared_ptr<HiLok> &mgr, std::string_view path) = 0;
+    };
+
+    char m_sep;
+    int m_flags;
+
+    HiLok(char sep = '/', int flags=HiFlags::RECURSIVE);
     
     HiLok(char, bool) = delete;
     
@@ -247,16 +1621,73 @@ public:
 
     bool is_recursive() {return m_flags & (HiFlags::RECURSIVE_MODE_MASK);}
 
-    std::shared_ptr<HiKeyNode> find_node(std::string_view path_from);
+    // path's node, null if it has none
+    std::shared_ptr<HiKeyNode> find_node(std::string_view path_from) { return m_impl->find_node(path_from); }
 
-    std::shared_ptr<HiHandle> read(std::shared_ptr<HiLok> mgr, std::string_view path, bool block = true, double timeout = 0);
+    // a timeout covers the whole path, however many nodes on it have to be waited for
+    std::shared_ptr<HiHandle> read(std::shared_ptr<HiLok> mgr, std::string_view path, bool block = true, double timeout = 0) {
+        return m_impl->read(mgr, path, HiWait(block, timeout));
+    }
     
-    std::shared_ptr<HiHandle> write(std::shared_ptr<HiLok> mgr, std::string_view path, bool block = true, double timeout = 0);
+    std::shared_ptr<HiHandle> write(std::shared_ptr<HiLok> mgr, std::string_view path, bool block = true, double timeout = 0) {
+        return m_impl->write(mgr, path, HiWait(block, timeout));
+    }
+
+    // READ_TREE keeps writers out of the whole subtree, SIX too, while its holder writes below it through write_child
+    // UPDATE reads alongside other readers, until its holder upgrades it
+    std::shared_ptr<HiHandle> lock(std::shared_ptr<HiLok> mgr, std::string_view path, HiMode mode, bool block = true, double timeout = 0) {
+        return m_impl->lock(mgr, path, mode, HiWait(block, timeout));
+    }
+
+    void rename(std::string_view from, std::string_view to, bool block = true, double timeout = 0) {
+        m_impl->rename(from, to, HiWait(block, timeout));
+    }
+
+    // same, with an absolute deadline, for callers that split one budget over several calls
+    std::shared_ptr<HiHandle> read_until(std::shared_ptr<HiLok> mgr, std::string_view path, std::chrono::steady_clock::time_point deadline) {
+        return m_impl->read(mgr, path, HiWait::until(deadline));
+    }
+
+    std::shared_ptr<HiHandle> write_until(std::shared_ptr<HiLok> mgr, std::string_view path, std::chrono::steady_clock::time_point deadline) {
+        return m_impl->write(mgr, path, HiWait::until(deadline));
+    }
+
+    void rename_until(std::string_view from, std::string_view to, std::chrono::steady_clock::time_point deadline) {
+        m_impl->rename(from, to, HiWait::until(deadline));
+    }
+
+    // all the moves or none, sharing the lookups and destination locks of moves out of and into the same directories
+    void rename_many(const std::vector<std::pair<std::string_view, std::string_view>> &moves, bool block = true, double timeout = 0) {
+        m_impl->rename_many(moves, HiWait(block, timeout));
+    }
+
+    // all the locks or none, taken in tree order, so two lock_many calls can't deadlock each other
+    std::shared_ptr<HiHandle> lock_many(std::shared_ptr<HiLok> mgr, const std::vector<std::pair<std::string_view, HiMode>> &paths, bool block = true, double timeout = 0) {
+        return m_impl->lock_many(mgr, paths, HiWait(block, timeout));
+    }
+
+    // mgr is kept alive by the prepared path
+    std::shared_ptr<HiPrepared> prepare(std::shared_ptr<HiLok> mgr, std::string_view path) {
+        return m_impl->prepare(mgr, path);
+    }
+
+    size_t size() { return m_impl->size(); };
+
+    // debugging aid, visits (parent node, name, node) for every node
+    void for_each_node(const std::function<void(const void *parent, std::string_view name, const void *node)> &f) {
+        m_impl->for_each_node(f);
+    }
+
+    // with CACHE_PATHS, forgets this thread's cached paths, so their nodes can go
+    void flush_path_cache() { m_impl->flush_path_cache(); }
 
-    void rename(std::string_view from, std::string_view to, bool block = true, double timeout = 0);
+    // keep about max idle nodes around, so hot paths aren't erased and rebuilt on every release
+    // idle nodes count in size(), 0 (the default) erases them right away
+    void set_idle_retention(size_t max) { m_impl->set_idle_retention(max); }
 
-    void erase_safe(std::shared_ptr<HiKeyNode> &ref);
-    void erase_unsafe(std::shared_ptr<HiKeyNode> &ref);
+    // with DEFER_ERASE, erases the idle nodes that are still waiting for a batch
+    void reclaim() { m_impl->reclaim(); }
 
-    size_t size() const { return m_map.size(); };
+private:
+    std::unique_ptr<Impl> m_impl;
 };
@@ -0,0 +1,253 @@
+#pragma once
+#include <string_view>
+#include <string>
+#include <cstring>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <array>
+#include <unordered_map>
+#include <new>
+
+// shared storage for long names, each distinct name is kept once
+// entries are counted by the HiNames that point at them, and freed with the last one
+// interning only happens when a node is created, lookups never touch the table
+class HiNameTable {
+public:
+    struct Entry {
+        HiNameTable *m_table;
+        uint32_t m_refs;        // guarded by the shard mutex
+        uint32_t m_shard;
+        size_t m_len;
+
+        const char *chars() const {
+            return reinterpret_cast<const char *>(this + 1);
+        }
+
+        std::string_view view() const {
+            return std::string_view(chars(), m_len);
+        }
+    };
+
+    HiNameTable() = default;
+    HiNameTable(const HiNameTable &) = delete;
+    HiNameTable & operator= (const HiNameTable &) = delete;
+
+    // every HiName pointing in here must be gone by now
+    ~HiNameTable() {
+        for (auto &sh : m_shards)
+            for (auto &it : sh.m_entries)
+                free_entry(it.second);
+    }
+
+    Entry *intern(std::string_view vw) {
+        size_t index = shard_index(vw);
+        auto &sh = m_shards[index];
+        std::lock_guard<std::mutex> guard(sh.m_mutex);
+        auto it = sh.m_entries.find(vw);
+        if (it != sh.m_entries.end()) {
+            ++it->second->m_refs;
+            return it->second;
+        }
+        void *mem = ::operator new(sizeof(Entry) + vw.size());
+        auto entry = new (mem) Entry{this, 1, static_cast<uint32_t>(index), vw.size()};
+        memcpy(const_cast<char *>(entry->chars()), vw.data(), vw.size());
+        try {
+            sh.m_entries.emplace(entry->view(), entry);
+        } catch (...) {
+            free_entry(entry);
+            throw;
+        }
+        return entry;
+    }
+
+    void release(Entry *entry) {
+        auto &sh = m_shards[entry->m_shard];
+        std::lock_guard<std::mutex> guard(sh.m_mutex);
+        if (--entry->m_refs == 0) {
+            sh.m_entries.erase(entry->view());
+            free_entry(entry);
+        }
+    }
+
+    // distinct names held
+    size_t size() {
+        size_t ret = 0;
+        for (auto &sh : m_shards) {
+            std::lock_guard<std::mutex> guard(sh.m_mutex);
+            ret += sh.m_entries.size();
+        }
+        return ret;
+    }
+
+private:
+    static const size_t num_shards = 16;
+
+    struct Shard {
+        std::mutex m_mutex;
+        std::unordered_map<std::string_view, Entry *> m_entries;   // keys view the entry's chars
+    };
+
+    static size_t shard_index(std::string_view vw) {
+        return (std::hash<std::string_view>()(vw) * 0x9E3779B97F4A7C15ULL) >> 60;
+    }
+
+    static void free_entry(Entry *entry) {
+        entry->~Entry();
+        ::operator delete(entry);
+    }
+
+    std::array<Shard, num_shards> m_shards;
+};
+
+// path component name, 24 bytes
+// names up to 23 chars are stored inline, longer ones in a heap buffer, or in a HiNameTable if one is given
+class HiName {
+    static const size_t inline_max = 23;
+    static const uint8_t HEAP = 0xFF;
+    static const uint8_t INTERNED = 0xFE;
+
+    // inline: the chars
+    // heap: pointer and length, copied in and out with memcpy
+    // interned: table entry pointer
+    char m_buf[inline_max];
+    uint8_t m_len;              // inline length, HEAP or INTERNED
+
+    const char *heap_ptr() const {
+        const char *ptr;
+        memcpy(&ptr, m_buf, sizeof(ptr));
+        return ptr;
+    }
+
+    size_t heap_len() const {
+        size_t len;
+        memcpy(&len, m_buf + sizeof(char *), sizeof(len));
+        return len;
+    }
+
+    void assign(std::string_view vw) {
+        if (vw.size() <= inline_max) {
+            memcpy(m_buf, vw.data(), vw.size());
+            m_len = static_cast<uint8_t>(vw.size());
+        } else {
+            char *ptr = new char[vw.size()];
+            size_t len = vw.size();
+            memcpy(ptr, vw.data(), len);
+            memcpy(m_buf, &ptr, sizeof(ptr));
+            memcpy(m_buf + sizeof(ptr), &len, sizeof(len));
+            m_len = HEAP;
+        }
+    }
+
+    HiNameTable::Entry *entry() const {
+        HiNameTable::Entry *ptr;
+        memcpy(&ptr, m_buf, sizeof(ptr));
+        return ptr;
+    }
+
+    void clear() {
+        if (m_len == HEAP)
+            delete[] heap_ptr();
+        else if (m_len == INTERNED)
+            entry()->m_table->release(entry());
+        m_len = 0;
+    }
+
+    void steal(HiName &other) {
+        memcpy(m_buf, other.m_buf, sizeof(m_buf));
+        m_len = other.m_len;
+        other.m_len = 0;
+    }
+
+public:
+    HiName() : m_len(0) {
+    }
+
+    HiName(std::string_view vw) {
+        assign(vw);
+    }
+
+    HiName(const std::string &str) : HiName(std::string_view(str)) {
+    }
+
+    HiName(const char *str) : HiName(std::string_view(str)) {
+    }
+
+    // long names go in the table, if there is one
+    HiName(std::string_view vw, HiNameTable *table) {
+        if (table && vw.size() > inline_max) {
+            auto ptr = table->intern(vw);
+            memcpy(m_buf, &ptr, sizeof(ptr));
+            m_len = INTERNED;
+        } else {
+            assign(vw);
+        }
+    }
+
+    // copies are plain, never interned
+    HiName(const HiName &other) {
+        assign(other.view());
+    }
+
+    HiName(HiName &&other) noexcept {
+        steal(other);
+    }
+
+    HiName & operator= (const HiName &other) {
+        if (this != &other) {
+            clear();
+            assign(other.view());
+        }
+        return *this;
+    }
+
+    HiName & operator= (HiName &&other) noexcept {
+        if (this != &other) {
+            clear();
+            steal(other);
+        }
+        return *this;
+    }
+
+    ~HiName() {
+        clear();
+    }
+
+    std::string_view view() const {
+        if (m_len == HEAP)
+            return std::string_view(heap_ptr(), heap_len());
+        if (m_len == INTERNED)
+            return entry()->view();
+        return std::string_view(m_buf, m_len);
+    }
+
+    size_t size() const {
+        return view().size();
+    }
+
+    bool is_interned() const {
+        return m_len == INTERNED;
+    }
+
+    // bytes allocated beyond sizeof(HiName), not counting shared table entries
+    size_t heap_size() const {
+        return m_len == HEAP ? heap_len() : 0;
+    }
+
+    bool operator == (const HiName &other) const {
+        return view() == other.view();
+    }
+
+    bool operator != (const HiName &other) const {
+        return !(*this == other);
+    }
+};
+
+namespace std {
+template <>
+struct hash<HiName> {
+    size_t operator()(const HiName &name) const {
+        return hash<string_view>()(name.view());
+    }
+};
+}
@@ -0,0 +1,228 @@
+#pragma once
+#include <atomic>
+#include <mutex>
+#include <new>
+#include <cstdint>
+#include <utility>
+#include <array>
+#include <thread>
+#include <functional>
+
+// fixed size blocks for lock nodes, carved out of aligned slabs that are kept until the pool goes away
+// a node finds its pool from its own address, so it doesn't have to store it
+//
+// freed blocks are pushed on a lock free stack, and only taken off under the pool mutex, so there's no ABA
+// allocations are made from one of a few caches, picked by thread, refilled a batch at a time from that stack,
+// so an idle cache can't hoard more than a batch
+template <class Node>
+class HiNodePool {
+    struct Block {
+        Block *m_next;
+    };
+
+    struct Slab {
+        HiNodePool *m_pool;
+        Slab *m_next;
+    };
+
+    static const size_t slab_size = 16384;
+    static const size_t refill_batch = 16;
+    static const size_t num_caches = 16;
+    static const size_t block_size = (sizeof(Node) + alignof(Node) - 1) / alignof(Node) * alignof(Node);
+    static const size_t first_block = (sizeof(Slab) + alignof(Node) - 1) / alignof(Node) * alignof(Node);
+    static_assert(first_block + block_size <= slab_size, "node too big for a slab");
+
+    std::atomic<Block *> m_returned;
+    std::mutex m_mutex;         // guards carving and taking from m_returned
+    Slab *m_slabs;
+    char *m_next;
+    char *m_end;
+    size_t m_num_blocks;
+
+    static HiNodePool *pool_of(void *ptr) {
+        return reinterpret_cast<Slab *>(reinterpret_cast<uintptr_t>(ptr) & ~(slab_size - 1))->m_pool;
+    }
+
+    Block *refill(Block *&cache) {
+        std::lock_guard<std::mutex> guard(m_mutex);
+        // pushes may race with us, but nobody else pops, so a head we've seen can't be recycled under us
+        Block *head = m_returned.load(std::memory_order_acquire);
+        for (size_t i = 0; head && i < refill_batch; ) {
+            if (m_returned.compare_exchange_weak(head, head->m_next, std::memory_order_acquire, std::memory_order_acquire)) {
+                head->m_next = cache;
+                cache = head;
+                head = m_returned.load(std::memory_order_acquire);
+                ++i;
+            }
+        }
+        if (cache) {
+            Block *block = cache;
+            cache = block->m_next;
+            return block;
+        }
+        return carve();
+    }
+
+    Block *carve() {
+        // caller holds m_mutex
+        if (m_end - m_next < static_cast<ptrdiff_t>(block_size)) {
+            auto slab = static_cast<Slab *>(::operator new(slab_size, std::align_val_t(slab_size)));
+            slab->m_pool = this;
+            slab->m_next = m_slabs;
+            m_slabs = slab;
+            m_next = reinterpret_cast<char *>(slab) + first_block;
+            m_end = reinterpret_cast<char *>(slab) + slab_size;
+        }
+        void *ret = m_next;
+        m_next += block_size;
+        ++m_num_blocks;
+        return static_cast<Block *>(ret);
+    }
+
+    void *allocate(Block *&cache) {
+        if (Block *block = cache) {
+            cache = block->m_next;
+            return block;
+        }
+        return refill(cache);
+    }
+
+    void deallocate(void *ptr) {
+        auto block = static_cast<Block *>(ptr);
+        block->m_next = m_returned.load(std::memory_order_relaxed);
+        while (!m_returned.compare_exchange_weak(block->m_next, block, std::memory_order_release, std::memory_order_relaxed)) {
+        }
+    }
+
+    struct alignas(64) Cache {
+        std::mutex m_mutex;
+        Block *m_free = nullptr;
+    };
+
+    std::array<Cache, num_caches> m_caches;
+
+public:
+    HiNodePool() : m_returned(nullptr), m_slabs(nullptr), m_next(nullptr), m_end(nullptr), m_num_blocks(0) {
+    }
+
+    HiNodePool(const HiNodePool &) = delete;
+    HiNodePool & operator= (const HiNodePool &) = delete;
+
+    // every node must be gone by now
+    ~HiNodePool() {
+        while (m_slabs) {
+            auto next = m_slabs->m_next;
+            ::operator delete(m_slabs, std::align_val_t(slab_size));
+            m_slabs = next;
+        }
+    }
+
+    template <class... Args>
+    Node *create(Args &&... args) {
+        void *mem;
+        {
+            auto &cache = m_caches[std::hash<std::thread::id>()(std::this_thread::get_id()) % num_caches];
+            std::lock_guard<std::mutex> guard(cache.m_mutex);
+            mem = allocate(cache.m_free);
+        }
+        try {
+            return new (mem) Node(std::forward<Args>(args)...);
+        } catch (...) {
+            deallocate(mem);
+            throw;
+        }
+    }
+
+    static void destroy(Node *node) {
+        auto pool = pool_of(node);
+        node->~Node();
+        pool->deallocate(node);
+    }
+
+    // blocks ever carved, free or not
+    size_t capacity() {
+        std::lock_guard<std::mutex> guard(m_mutex);
+        return m_num_blocks;
+    }
+};
+
+// intrusive reference to a pooled node, the count lives in the node (add_ref/release_ref)
+template <class Node>
+class HiNodeRef {
+    Node *m_ptr;
+
+    void drop() {
+        if (m_ptr && m_ptr->release_ref())
+            HiNodePool<Node>::destroy(m_ptr);
+    }
+
+public:
+    HiNodeRef() : m_ptr(nullptr) {
+    }
+
+    explicit HiNodeRef(Node *ptr) : m_ptr(ptr) {
+        if (m_ptr)
+            m_ptr->add_ref();
+    }
+
+    // takes over a reference the caller added by hand
+    static HiNodeRef adopt(Node *ptr) {
+        HiNodeRef ret;
+        ret.m_ptr = ptr;
+        return ret;
+    }
+
+    HiNodeRef(const HiNodeRef &other) : HiNodeRef(other.m_ptr) {
+    }
+
+    HiNodeRef(HiNodeRef &&other) noexcept : m_ptr(other.m_ptr) {
+        other.m_ptr = nullptr;
+    }
+
+    HiNodeRef & operator= (const HiNodeRef &other) {
+        HiNodeRef(other).swap(*this);
+        return *this;
+    }
+
+    HiNodeRef & operator= (HiNodeRef &&other) noexcept {
+        HiNodeRef(std::move(other)).swap(*this);
+        return *this;
+    }
+
+    ~HiNodeRef() {
+        drop();
+    }
+
+    void swap(HiNodeRef &other) noexcept {
+        std::swap(m_ptr, other.m_ptr);
+    }
+
+    void reset() {
+        drop();
+        m_ptr = nullptr;
+    }
+
+    Node *get() const {
+        return m_ptr;
+    }
+
+    Node *operator-> () const {
+        return m_ptr;
+    }
+
+    Node & operator* () const {
+        return *m_ptr;
+    }
+
+    explicit operator bool() const {
+        return m_ptr != nullptr;
+    }
+
+    bool operator == (const HiNodeRef &other) const {
+        return m_ptr == other.m_ptr;
+    }
+
+    bool operator != (const HiNodeRef &other) const {
+        return m_ptr != other.m_ptr;
+    }
+};
@@ -1,6 +1,13 @@
 #pragma once
 #include <string_view>
 #include <string>
+#include <vector>
+#include <stdexcept>
+
+#if defined(__SSE2__) && defined(__GNUC__)
+#include <emmintrin.h>
+#define HILOK_SSE2_SPLIT
+#endif
 
 class PathSplit {
   
@@ -28,11 +35,12 @@ public:
         seek_next();
     }
 
-    std::string operator *() {
+    // views the path, no copy
+    std::string_view operator *() {
         if (m_next != std::string_view::npos) {
-            return std::string(m_vw.substr(0, m_next));
+            return m_vw.substr(0, m_next);
         } else {
-            return std::string(m_vw);
+            return m_vw;
         }
     }
 
@@ -57,3 +65,73 @@ public:
     }
 
 };
+
+// a path split up front, in one pass, into component offsets
+// empty components (leading, trailing and repeated separators) are dropped during the scan
+// up to inline_max components live in the object itself, deeper paths spill to the heap
+// views the path, which must outlive it
+class PathTokens {
+public:
+    static const size_t inline_max = 16;
+
+    PathTokens(std::string_view path, char sep='/') : m_path(path), m_size(0) {
+        const char *p = path.data();
+        size_t n = path.size();
+        size_t start = 0;
+        size_t i = 0;
+#ifdef HILOK_SSE2_SPLIT
+        // 16 bytes at a time, each set bit in the mask is a separator
+        const __m128i vsep = _mm_set1_epi8(sep);
+        for (; i + 16 <= n; i += 16) {
+            auto chunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + i));
+            unsigned mask = static_cast<unsigned>(_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, vsep)));
+            while (mask) {
+                size_t pos = i + static_cast<size_t>(__builtin_ctz(mask));
+                add(start, pos);
+                start = pos + 1;
+                mask &= mask - 1;
+            }
+        }
+#endif
+        for (; i < n; ++i) {
+            if (p[i] == sep) {
+                add(start, i);
+                start = i + 1;
+            }
+        }
+        add(start, n);
+    }
+
+    size_t size() const {
+        return m_size;
+    }
+
+    // past the end is an empty name, like PathSplit at its end
+    std::string_view operator[](size_t i) const {
+        if (i >= m_size)
+            return std::string_view();
+        const Span &sp = i < inline_max ? m_inline[i] : m_spill[i - inline_max];
+        return m_path.substr(sp.m_off, sp.m_len);
+    }
+
+private:
+    struct Span {
+        size_t m_off;
+        size_t m_len;
+    };
+
+    void add(size_t begin, size_t end) {
+        if (end == begin)
+            return;
+        if (m_size < inline_max)
+            m_inline[m_size] = {begin, end - begin};
+        else
+            m_spill.push_back({begin, end - begin});
+        ++m_size;
+    }
+
+    std::string_view m_path;
+    Span m_inline[inline_max];
+    std::vector<Span> m_spill;
+    size_t m_size;
+};
@@ -15,8 +15,20 @@ PYBIND11_MODULE(hilok, m)
         .value("RECURSIVE_WRITE", HiFlags::RECURSIVE_WRITE)
         .value("RECURSIVE_ONEWAY", HiFlags::RECURSIVE_ONEWAY)
         .value("RECURSIVE", HiFlags::RECURSIVE)
+        .value("READ_BIASED", HiFlags::READ_BIASED)
+        .value("FAIR", HiFlags::FAIR)
+        .value("INTERN_NAMES", HiFlags::INTERN_NAMES)
+        .value("CACHE_PATHS", HiFlags::CACHE_PATHS)
+        .value("DEFER_ERASE", HiFlags::DEFER_ERASE)
         .value("LOOSE_UNLOCK", static_cast<HiFlags>(HiFlags::LOOSE_READ_UNLOCK + HiFlags::LOOSE_WRITE_UNLOCK));
 
+    py::enum_<HiMode>(m, "HiLokMode")
+        .value("READ", HiMode::READ)
+        .value("UPDATE", HiMode::UPDATE)
+        .value("READ_TREE", HiMode::READ_TREE)
+        .value("SIX", HiMode::SIX)
+        .value("WRITE", HiMode::WRITE);
+
     py::class_<HiLok, std::shared_ptr<HiLok>>(m, "HiLok")
         .def(py::init<>())
         .def(py::init<char>(), py::arg("sep") = '/')
@@ -37,6 +49,14 @@ PYBIND11_MODULE(hilok, m)
                     timeout = 0.0;
                 return lok->read(lok, path, block.value(), timeout.value());
             }, py::arg("path"), py::arg("block") = true, py::arg("timeout") = 0.0)
+        .def("lock", [](std::shared_ptr<HiLok> lok, std::string_view path, HiMode mode, std::optional<bool> block, std::optional<double> timeout) {
+                py::gil_scoped_release _gil_rel;
+                if (!block.has_value())
+                    block = true;
+                if (!timeout.has_value())
+                    timeout = 0.0;
+                return lok->lock(lok, path, mode, block.value(), timeout.value());
+            }, py::arg("path"), py::arg("mode"), py::arg("block") = true, py::arg("timeout") = 0.0)
         .def("rename", [](std::shared_ptr<HiLok> lok, std::string_view from, std::string_view to, std::optional<bool> block, std::optional<double> timeout) {
                 py::gil_scoped_release _gil_rel;
                 if (!block.has_value())
@@ -45,10 +65,87 @@ PYBIND11_MODULE(hilok, m)
                     timeout = 0.0;
                 return lok->rename(from, to, block.value(), timeout.value());
             }, py::arg("from"), py::arg("to"), py::arg("block") = true, py::arg("timeout") = 0.0)
+        .def("rename_many", [](std::shared_ptr<HiLok> lok, const std::vector<std::pair<std::string, std::string>> &pairs, std::optional<bool> block, std::optional<double> timeout) {
+                py::gil_scoped_release _gil_rel;
+                if (!block.has_value())
+                    block = true;
+                if (!timeout.has_value())
+                    timeout = 0.0;
+                std::vector<std::pair<std::string_view, std::string_view>> moves(pairs.begin(), pairs.end());
+                return lok->rename_many(moves, block.value(), timeout.value());
+            }, py::arg("pairs"), py::arg("block") = true, py::arg("timeout") = 0.0)
+        .def("lock_many", [](std::shared_ptr<HiLok> lok, const std::vector<std::pair<std::string, HiMode>> &requests, std::optional<bool> block, std::optional<double> timeout) {
+                py::gil_scoped_release _gil_rel;
+                if (!block.has_value())
+                    block = true;
+                if (!timeout.has_value())
+                    timeout = 0.0;
+                std::vector<std::pair<std::string_view, HiMode>> paths(requests.begin(), requests.end());
+                return lok->lock_many(lok, paths, block.value(), timeout.value());
+            }, py::arg("requests"), py::arg("block") = true, py::arg("timeout") = 0.0)
+        .def("flush_path_cache", [](std::shared_ptr<HiLok> lok) {
+                py::gil_scoped_release _gil_rel;
+                lok->flush_path_cache();
+            })
+        .def("set_idle_retention", [](std::shared_ptr<HiLok> lok, size_t max) {
+                py::gil_scoped_release _gil_rel;
+                lok->set_idle_retention(max);
+            }, py::arg("max"))
+        .def("reclaim", [](std::shared_ptr<HiLok> lok) {
+                py::gil_scoped_release _gil_rel;
+                lok->reclaim();
+            })
+        .def("prepare", [](std::shared_ptr<HiLok> lok, std::string_view path) {
+                py::gil_scoped_release _gil_rel;
+                return lok->prepare(lok, path);
+            }, py::arg("path"))
+        ;
+
+    py::class_<HiPrepared, std::shared_ptr<HiPrepared>>(m, "HiPrepared")
+        .def("write", [](std::shared_ptr<HiPrepared> prep, std::optional<bool> block, std::optional<double> timeout) {
+                py::gil_scoped_release _gil_rel;
+                if (!block.has_value())
+                    block = true;
+                if (!timeout.has_value())
+                    timeout = 0.0;
+                return prep->write(block.value(), timeout.value());
+            }, py::arg("block") = true, py::arg("timeout") = 0.0)
+        .def("read", [](std::shared_ptr<HiPrepared> prep, std::optional<bool> block, std::optional<double> timeout) {
+                py::gil_scoped_release _gil_rel;
+                if (!block.has_value())
+                    block = true;
+                if (!timeout.has_value())
+                    timeout = 0.0;
+                return prep->read(block.value(), timeout.value());
+            }, py::arg("block") = true, py::arg("timeout") = 0.0)
         ;
 
     py::class_<HiHandle, std::shared_ptr<HiHandle>>(m, "HiHandle")
         .def("release", &HiHandle::release)
+        .def("write_child", [](std::shared_ptr<HiHandle> hh, std::string_view relpath, std::optional<bool> block, std::optional<double> timeout) {
+                py::gil_scoped_release _gil_rel;
+                if (!block.has_value())
+                    block = true;
+                if (!timeout.has_value())
+                    timeout = 0.0;
+                return hh->write_child(relpath, block.value(), timeout.value());
+            }, py::arg("relpath"), py::arg("block") = true, py::arg("timeout") = 0.0)
+        .def("read_child", [](std::shared_ptr<HiHandle> hh, std::string_view relpath, std::optional<bool> block, std::optional<double> timeout) {
+                py::gil_scoped_release _gil_rel;
+                if (!block.has_value())
+                    block = true;
+                if (!timeout.has_value())
+                    timeout = 0.0;
+                return hh->read_child(relpath, block.value(), timeout.value());
+            }, py::arg("relpath"), py::arg("block") = true, py::arg("timeout") = 0.0)
+        .def("upgrade", [](std::shared_ptr<HiHandle> hh, std::optional<bool> block, std::optional<double> timeout) {
+                py::gil_scoped_release _gil_rel;
+                if (!block.has_value())
+                    block = true;
+                if (!timeout.has_value())
+                    timeout = 0.0;
+                hh->upgrade(block.value(), timeout.value());
+            }, py::arg("block") = true, py::arg("timeout") = 0.0)
         .def("__enter__", [](std::shared_ptr<HiHandle> hh) {return hh;})
         .def("__exit__", [](std::shared_ptr<HiHandle> hh, const py::object &, const py::object &, const py::object &) { hh->release(); })
         ;
@@ -1,63 +1,410 @@
 #include "recsh.hpp"
 #include <mutex>
-#include <iostream>
+#include <climits>
 
-bool recursive_shared_mutex::try_lock_for(const std::chrono::duration<double> &secs)
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <ctime>
+
+static void futex_wait(std::atomic<uint32_t> &word, uint32_t val, const struct timespec *timeout)
+{
+    syscall(SYS_futex, reinterpret_cast<uint32_t *>(&word), FUTEX_WAIT_PRIVATE, val, timeout, nullptr, 0);
+}
+
+static void futex_wake(std::atomic<uint32_t> &word)
+{
+    syscall(SYS_futex, reinterpret_cast<uint32_t *>(&word), FUTEX_WAKE_PRIVATE, 1, nullptr, nullptr, 0);
+}
+#endif
+
+recursive_shared_mutex::stripe recursive_shared_mutex::s_stripes[recursive_shared_mutex::num_stripes];
+
+void recursive_shared_mutex::enqueue(waiter &w)
+{
+    auto &st = get_stripe();
+    std::lock_guard<std::mutex> sync_lock(st.m_mtx);
+    if (st.m_tail)
+        st.m_tail->m_next = &w;
+    else
+        st.m_head = &w;
+    st.m_tail = &w;
+    m_state.fetch_or(w.m_exclusive ? WAITERS | WRITER_WAITING : WAITERS);
+}
+
+bool recursive_shared_mutex::has_waiter_locked(stripe &st, bool exclusive)
+{
+    // the queue is shared with other mutexes in the stripe, but it's short
+    for (auto w = st.m_head; w; w = w->m_next)
+        if (w->m_lock == this && (!exclusive || w->m_exclusive))
+            return true;
+    return false;
+}
+
+void recursive_shared_mutex::dequeue(waiter &w, bool acquired)
+{
+    auto &st = get_stripe();
+    std::lock_guard<std::mutex> sync_lock(st.m_mtx);
+    waiter *prev = nullptr;
+    for (auto cur = st.m_head; cur != &w; cur = cur->m_next)
+        prev = cur;
+    if (prev)
+        prev->m_next = w.m_next;
+    else
+        st.m_head = w.m_next;
+    if (st.m_tail == &w)
+        st.m_tail = prev;
+    if (w.m_exclusive && !has_waiter_locked(st, true))
+        m_state.fetch_and(~WRITER_WAITING);
+    if (!has_waiter_locked(st, false))
+        m_state.fetch_and(~WAITERS);
+    else if (!acquired)
+        // we may have been handed a wakeup we won't use
+        wake_waiters_locked(st);
+}
+
+bool recursive_shared_mutex::wait_signal(waiter &w, const deadline_t *deadline)
+{
+#ifdef __linux__
+    while (!w.m_signal.exchange(0)) {
+        struct timespec ts;
+        struct timespec *tsp = nullptr;
+        if (deadline) {
+            auto left = *deadline - std::chrono::steady_clock::now();
+            if (left <= left.zero())
+                return false;
+            auto secs = std::chrono::duration_cast<std::chrono::seconds>(left);
+            ts.tv_sec = secs.count();
+            ts.tv_nsec = std::chrono::duration_cast<std::chrono::nanoseconds>(left - secs).count();
+            tsp = &ts;
+        }
+        futex_wait(w.m_signal, 0, tsp);
+    }
+    return true;
+#else
+    std::unique_lock<std::mutex> sync_lock(get_stripe().m_mtx);
+    auto signaled = [&w] { return w.m_signal.load() != 0; };
+    if (deadline) {
+        if (!w.m_cond_var.wait_until(sync_lock, *deadline, signaled))
+            return false;
+    } else {
+        w.m_cond_var.wait(sync_lock, signaled);
+    }
+    w.m_signal = 0;
+    return true;
+#endif
+}
+
+void recursive_shared_mutex::signal(waiter &w)
 {
-    std::unique_lock<std::mutex> sync_lock(m_mtx);
-    if (!m_cond_var.wait_for(sync_lock, secs, [this] { return can_exclusively_lock(); })) {
+    // caller holds the stripe mutex, so the waiter can't leave (and free w) before we are done with it
+    w.m_signal = 1;
+#ifdef __linux__
+    futex_wake(w.m_signal);
+#else
+    w.m_cond_var.notify_one();
+#endif
+}
+
+void recursive_shared_mutex::wake_waiters()
+{
+    auto &st = get_stripe();
+    std::lock_guard<std::mutex> sync_lock(st.m_mtx);
+    wake_waiters_locked(st);
+}
+
+void recursive_shared_mutex::wake_waiters_locked(stripe &st)
+{
+    // wake only those who can get the lock now: every compatible reader, or else the first writer that can
+    // writers that can't proceed don't hold up readers, and a reader escalating behind a waiting writer isn't stuck
+    uint64_t s = m_state.load();
+    bool woke = false;
+    for (auto w = st.m_head; w; w = w->m_next) {
+        if (w->m_lock != this)
+            continue;
+        if (w->m_exclusive) {
+            if (!woke && can_lock_exclusive(s, w->m_id)) {
+                signal(*w);
+                return;
+            }
+        } else if (can_lock_shared(s, w->m_id) && !must_yield_to_writer(s, w->m_id)) {
+            signal(*w);
+            woke = true;
+        }
+    }
+}
+
+template <class Attempt>
+bool recursive_shared_mutex::try_once(Attempt attempt)
+{
+    while (true) {
+        uint64_t s;
+        auto ret = attempt(s);
+        if (ret != RETRY)
+            return ret == ACQUIRED;
+    }
+}
+
+template <class Attempt>
+bool recursive_shared_mutex::acquire(Attempt attempt, std::thread::id id, bool exclusive, const deadline_t *deadline)
+{
+    if (try_once(attempt))
+        return true;
+    if (deadline && std::chrono::steady_clock::now() >= *deadline)
         return false;
+
+    waiter w(this, id, exclusive);
+    enqueue(w);
+    // once queued, any release sees WAITERS and checks the queue, so a failed attempt can safely wait
+    bool acquired;
+    while (!(acquired = try_once(attempt))) {
+        if (!wait_signal(w, deadline)) {
+            acquired = try_once(attempt);
+            break;
+        }
     }
-    if (is_exclusive_locked_on_this_thread())
-    {
-        increment_exclusive_lock();
+    dequeue(w, acquired);
+    return acquired;
+}
+
+recursive_shared_mutex::attempt recursive_shared_mutex::try_exclusive(std::thread::id id, uint64_t &s)
+{
+    s = m_state.load();
+    if (s & EXCLUSIVE) {
+        if (m_owner.load(std::memory_order_relaxed) == id && !m_solo_locked && (!m_one_way || !shared_count(s))) {
+            // recursive write, owner only, no atomics needed
+            m_exclusive_count++;
+            return ACQUIRED;
+        }
+        return BLOCKED;
     }
-    else
-    {
-        start_exclusive_lock();
+    if (shared_count(s)) {
+        // escalation: only when every shared lock is ours
+        if (m_wr_only || m_one_way)
+            return BLOCKED;
+        if (s & MULTI) {
+            std::lock_guard<std::mutex> map_lock(get_readers().m_mtx);
+            s = m_state.load();
+            if (!(s & MULTI))
+                return RETRY;
+            if ((s & EXCLUSIVE) || !is_shared_locked_only_on_thread(s, id))
+                return BLOCKED;
+            if (!m_state.compare_exchange_strong(s, s | EXCLUSIVE))
+                return RETRY;
+        } else {
+            if (m_sole.load(std::memory_order_relaxed) != id)
+                return BLOCKED;
+            if (!m_state.compare_exchange_weak(s, s | EXCLUSIVE))
+                return RETRY;
+        }
+    } else if (!m_state.compare_exchange_weak(s, s | EXCLUSIVE)) {
+        return RETRY;
     }
-    return true;
+    m_owner.store(id, std::memory_order_relaxed);
+    m_exclusive_count = 1;
+    m_solo_locked = false;
+    return ACQUIRED;
 }
 
-void recursive_shared_mutex::lock()
+recursive_shared_mutex::attempt recursive_shared_mutex::try_solo(std::thread::id id, uint64_t &s)
 {
-    std::unique_lock<std::mutex> sync_lock(m_mtx);
-    m_cond_var.wait(sync_lock, [this] { return can_exclusively_lock(); });
-    if (is_exclusive_locked_on_this_thread())
-    {
-        increment_exclusive_lock();
+    s = m_state.load();
+    if ((s & EXCLUSIVE) || shared_count(s))
+        return BLOCKED;
+    if (!m_state.compare_exchange_weak(s, s | EXCLUSIVE))
+        return RETRY;
+    m_owner.store(id, std::memory_order_relaxed);
+    m_exclusive_count = 1;
+    m_solo_locked = true;
+    return ACQUIRED;
+}
+
+recursive_shared_mutex::attempt recursive_shared_mutex::try_shared(std::thread::id id, uint64_t &s)
+{
+    s = m_state.load();
+    if (!can_lock_shared(s, id) || must_yield_to_writer(s, id))
+        return BLOCKED;
+    return add_shared(id, s);
+}
+
+recursive_shared_mutex::attempt recursive_shared_mutex::add_shared(std::thread::id id, uint64_t &s)
+{
+    if (s & MULTI)
+        return add_multi_shared(id, s);
+
+    if (!shared_count(s)) {
+        // first reader, becomes the sole owner
+        if (!m_state.compare_exchange_weak(s, s + 1 + EPOCH))
+            return RETRY;
+        m_sole.store(id, std::memory_order_relaxed);
+        return ACQUIRED;
     }
-    else
-    {
-        start_exclusive_lock();
+
+    if (m_sole.load(std::memory_order_relaxed) == id) {
+        if (!m_state.compare_exchange_weak(s, s + 1))
+            return RETRY;
+        return ACQUIRED;
     }
+
+    // another thread joins: move the sole owner's count into the map
+    auto &rd = get_readers();
+    std::unique_lock<std::mutex> map_lock(rd.m_mtx);
+    s = m_state.load();
+    if (s & MULTI) {
+        map_lock.unlock();
+        return add_multi_shared(id, s);
+    }
+    if (!shared_count(s))
+        return RETRY;
+    auto sole = m_sole.load(std::memory_order_relaxed);
+    if (sole == std::thread::id()) {
+        // sole owner is between its state change and publishing/clearing m_sole
+        map_lock.unlock();
+        std::this_thread::yield();
+        return RETRY;
+    }
+    if (!m_state.compare_exchange_strong(s, (s | MULTI) + 1))
+        return RETRY;
+    rd.m_counts.add(sole, shared_count(s));
+    rd.m_counts.add(id);
+    m_sole.store(std::thread::id(), std::memory_order_relaxed);
+    return ACQUIRED;
 }
 
-bool recursive_shared_mutex::try_lock()
+recursive_shared_mutex::attempt recursive_shared_mutex::add_multi_shared(std::thread::id id, uint64_t &s)
+{
+    auto &rd = get_readers();
+    std::lock_guard<std::mutex> map_lock(rd.m_mtx);
+    s = m_state.load();
+    if (!(s & MULTI))
+        return RETRY;
+    if (!can_lock_shared(s, id))
+        return BLOCKED;
+    rd.m_counts.add(id);
+    // map changes are under the map mutex, only the waiter bits can change concurrently
+    m_state.fetch_add(1);
+    return ACQUIRED;
+}
+
+void recursive_shared_mutex::release_shared(std::thread::id id, bool any)
+{
+    while (true) {
+        uint64_t s = m_state.load();
+        if (!shared_count(s))
+            throw HiErr("Not shared locked, cannot shared unlock");
+        if (s & MULTI) {
+            if (release_multi_shared(id, any))
+                return;
+            continue;
+        }
+        auto sole = m_sole.load(std::memory_order_relaxed);
+        if (m_state.load() != s)
+            continue;
+        if (sole == std::thread::id()) {
+            std::this_thread::yield();
+            continue;
+        }
+        if (!any && sole != id)
+            throw HiErr("Calling shared unlock from the wrong thread");
+        if (shared_count(s) > 1) {
+            if (m_state.compare_exchange_weak(s, s - 1)) {
+                if (s & WAITERS)
+                    wake_waiters();
+                return;
+            }
+            continue;
+        }
+        // last shared lock: clear the owner first, nobody can join the sole owner while it's empty
+        m_sole.store(std::thread::id(), std::memory_order_relaxed);
+        while (!(s & MULTI)) {
+            if (m_state.compare_exchange_weak(s, s - 1)) {
+                if (s & WAITERS)
+                    wake_waiters();
+                return;
+            }
+        }
+        // converted to multi before we cleared, release via the map
+    }
+}
+
+bool recursive_shared_mutex::release_multi_shared(std::thread::id id, bool any)
 {
-    std::unique_lock<std::mutex> sync_lock(m_mtx);
-    if (can_increment_exclusive_lock())
+    uint64_t s;
     {
-        increment_exclusive_lock();
-        return true;
+        std::lock_guard<std::mutex> map_lock(get_readers().m_mtx);
+        s = m_state.load();
+        if (!(s & MULTI))
+            return false;
+        if (any)
+            decrement_any_shared_lock(id);
+        else
+            decrement_shared_lock(id);
+        while (true) {
+            uint64_t ns = s - 1;
+            if (shared_count(s) == 1)
+                ns &= ~MULTI;
+            if (m_state.compare_exchange_weak(s, ns))
+                break;
+        }
     }
-    if (can_start_exclusive_lock())
+    // the stripe mutex goes first, so wake after letting go of the map
+    if (s & WAITERS)
+        wake_waiters();
+    return true;
+}
+
+void recursive_shared_mutex::decrement_any_shared_lock(std::thread::id id)
+{
+    // caller holds the map mutex
+    auto &locks = get_readers().m_counts;
+    if (!locks.find(id))
     {
-        start_exclusive_lock();
-        return true;
+        if (!locks.size())
+            throw HiErr("Not shared locked, cannot shared unlock");
+        id = locks.first();
     }
-    return false;
+    locks.release(id);
 }
 
-bool recursive_shared_mutex::try_solo_lock()
+void recursive_shared_mutex::decrement_shared_lock(std::thread::id id)
 {
-    std::unique_lock<std::mutex> sync_lock(m_mtx);
-    if (can_start_solo_lock())
+    // in multi mode, so there are shared locks
+    auto &locks = get_readers().m_counts;
+    if (!locks.find(id))
     {
-        start_solo_lock();
-        return true;
+        throw HiErr("Calling shared unlock from the wrong thread");
     }
-    return false;
+    locks.release(id);
+}
+
+bool recursive_shared_mutex::try_lock_for(const std::chrono::duration<double> &secs)
+{
+    return try_lock_until(std::chrono::steady_clock::now() + std::chrono::duration_cast<std::chrono::steady_clock::duration>(secs));
+}
+
+bool recursive_shared_mutex::try_lock_until(const deadline_t &deadline)
+{
+    auto id = std::this_thread::get_id();
+    return acquire([this, id](uint64_t &s) { return try_exclusive(id, s); }, id, true, &deadline);
+}
+
+void recursive_shared_mutex::lock()
+{
+    auto id = std::this_thread::get_id();
+    acquire([this, id](uint64_t &s) { return try_exclusive(id, s); }, id, true, nullptr);
+}
+
+bool recursive_shared_mutex::try_lock()
+{
+    auto id = std::this_thread::get_id();
+    return try_once([this, id](uint64_t &s) { return try_exclusive(id, s); });
+}
+
+bool recursive_shared_mutex::try_solo_lock()
+{
+    auto id = std::this_thread::get_id();
+    return try_once([this, id](uint64_t &s) { return try_solo(id, s); });
 }
 
 void recursive_shared_mutex::unlock()
@@ -67,63 +414,81 @@ void recursive_shared_mutex::unlock()
 
 void recursive_shared_mutex::unlock(std::thread::id tid)
 {
+    uint64_t s = m_state.load();
+    if (!(s & EXCLUSIVE))
     {
-        std::unique_lock<std::mutex> sync_lock(m_mtx);
-        decrement_exclusive_lock(tid);
-        m_solo_locked = false;
+        throw HiErr("Not exclusively locked, cannot exclusively unlock");
     }
-    m_cond_var.notify_all();
+    if (m_owner.load(std::memory_order_relaxed) != tid)
+    {
+        throw HiErr("Calling exclusively unlock from the wrong thread");
+    }
+    m_solo_locked = false;
+    if (--m_exclusive_count > 0)
+        return;
+    m_owner.store(std::thread::id(), std::memory_order_relaxed);
+    while (!m_state.compare_exchange_weak(s, s & ~EXCLUSIVE)) {
+    }
+    if (s & WAITERS)
+        wake_waiters();
 }
 
 
 void recursive_shared_mutex::lock_shared()
 {
-    std::unique_lock<std::mutex> sync_lock(m_mtx);
-    m_cond_var.wait(sync_lock, [this] { return can_lock_shared(); });
-    increment_shared_lock();
+    auto id = std::this_thread::get_id();
+    acquire([this, id](uint64_t &s) { return try_shared(id, s); }, id, false, nullptr);
 }
 
 bool recursive_shared_mutex::try_lock_shared_for(const std::chrono::duration<double> &secs)
 {
-    std::unique_lock<std::mutex> sync_lock(m_mtx);
-    if(!m_cond_var.wait_for(sync_lock, secs, [this] { return can_lock_shared(); })) {
-        return false;
-    }
-    increment_shared_lock();
-    return true;
+    return try_lock_shared_until(std::chrono::steady_clock::now() + std::chrono::duration_cast<std::chrono::steady_clock::duration>(secs));
+}
+
+bool recursive_shared_mutex::try_lock_shared_until(const deadline_t &deadline)
+{
+    auto id = std::this_thread::get_id();
+    return acquire([this, id](uint64_t &s) { return try_shared(id, s); }, id, false, &deadline);
 }
 
 
 bool recursive_shared_mutex::try_lock_shared()
 {
-    std::unique_lock<std::mutex> sync_lock(m_mtx);
-    if (can_lock_shared())
-    {
-        increment_shared_lock();
-        return true;
-    }
-    return false;
+    auto id = std::this_thread::get_id();
+    return try_once([this, id](uint64_t &s) { return try_shared(id, s); });
 }
 
 void recursive_shared_mutex::unlock_shared()
 {
-    unlock_shared(std::this_thread::get_id());
+    release_shared(std::this_thread::get_id(), false);
 }
 
 void recursive_shared_mutex::unlock_shared(std::thread::id id)
 {
-    {
-        std::unique_lock<std::mutex> sync_lock(m_mtx);
-        decrement_shared_lock(id);
-    }
-    m_cond_var.notify_all();
+    release_shared(id, false);
+}
+
+void recursive_shared_mutex::adopt_shared(std::thread::id id)
+{
+    // record a shared lock that is already known to be compatible, on behalf of another thread
+    acquire([this, id](uint64_t &s) { s = m_state.load(); return add_shared(id, s); }, id, false, nullptr);
+}
+
+void recursive_shared_mutex::relock_shared()
+{
+    // take back a shared lock this thread just let go of, ahead of queued writers even in fair mode
+    // the caller knows any exclusive holder is about to back off, so wait it out without queueing
+    auto id = std::this_thread::get_id();
+    while (!try_once([this, id](uint64_t &s) {
+        s = m_state.load();
+        if (!can_lock_shared(s, id))
+            return BLOCKED;
+        return add_shared(id, s);
+    }))
+        std::this_thread::yield();
 }
 
 void recursive_shared_mutex::unlock_any_shared()
 {
-    {
-        std::unique_lock<std::mutex> sync_lock(m_mtx);
-        decrement_any_shared_lock(std::this_thread::get_id());
-    }
-    m_cond_var.notify_all();
+    release_shared(std::this_thread::get_id(), true);
 }
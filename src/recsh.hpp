@@ -1,209 +1,310 @@
 #ifndef _RECURSIVE_SHARED_MUTEX_H
 #define _RECURSIVE_SHARED_MUTEX_H
 
-// from https://stackoverflow.com/a/60046372/627042
+// api from https://stackoverflow.com/a/60046372/627042
 
 #include <thread>
 #include <mutex>
+#include <atomic>
+#include <chrono>
 #include <condition_variable>
-#include <map>
+#include <memory>
+#include <unordered_map>
 #include "hierr.hpp"
 
 
+// shared lock counts per owner
+// a few inline slots cover the usual handful of readers without allocating, more spill into a hash map
+template <class Key, class Hash = std::hash<Key>, size_t inline_slots = 4>
+class owner_count_map
+{
+public:
+    owner_count_map() : m_inline{}, m_size(0) {}
+
+    size_t size() const
+    {
+        return m_size;
+    }
+
+    size_t *find(const Key &id)
+    {
+        for (auto &slot : m_inline)
+            if (slot.first == id)
+                return &slot.second;
+        if (m_overflow) {
+            auto it = m_overflow->find(id);
+            if (it != m_overflow->end())
+                return &it->second;
+        }
+        return nullptr;
+    }
+
+    void add(const Key &id, size_t num = 1)
+    {
+        if (auto cnt = find(id)) {
+            *cnt += num;
+            return;
+        }
+        ++m_size;
+        for (auto &slot : m_inline) {
+            if (slot.first == Key()) {
+                slot = {id, num};
+                return;
+            }
+        }
+        if (!m_overflow)
+            m_overflow.reset(new std::unordered_map<Key, size_t, Hash>());
+        (*m_overflow)[id] = num;
+    }
+
+    // id must be an owner
+    void release(const Key &id)
+    {
+        for (auto &slot : m_inline) {
+            if (slot.first == id) {
+                if (--slot.second == 0) {
+                    slot.first = Key();
+                    --m_size;
+                }
+                return;
+            }
+        }
+        auto it = m_overflow->find(id);
+        if (--it->second == 0) {
+            m_overflow->erase(it);
+            --m_size;
+        }
+    }
+
+    // any owner, map must not be empty
+    Key first() const
+    {
+        return first_if([](const Key &) { return true; });
+    }
+
+    // any owner matching pred, or Key() if there is none
+    template <class Pred>
+    Key first_if(Pred pred) const
+    {
+        for (auto &slot : m_inline)
+            if (slot.first != Key() && pred(slot.first))
+                return slot.first;
+        if (m_overflow)
+            for (auto &it : *m_overflow)
+                if (pred(it.first))
+                    return it.first;
+        return Key();
+    }
+
+private:
+    std::pair<Key, size_t> m_inline[inline_slots];
+    size_t m_size;
+    std::unique_ptr<std::unordered_map<Key, size_t, Hash>> m_overflow;
+};
+
+typedef owner_count_map<std::thread::id> shared_owner_map;
+
+
+// Uncontended operations are a single CAS on m_state, and never take the stripe mutex.
+//
+// Shared lock owners are tracked in one of two ways:
+//  - "sole": every shared lock belongs to one thread, m_sole.   This is the fast path.
+//  - "multi": several threads hold shared locks, counts are kept in a map of the mutex's own.
+// The state goes back to sole as soon as the shared count drops to zero.
+//
+// Blocked threads queue up in FIFO order, each parked on its own signal.   A release only
+// wakes queued threads that can proceed in the new state: the compatible readers, or one writer.
+//
+// Everything that's only needed under contention lives off to the side: the queue and the mutex
+// guarding it in a global table of stripes, picked by the mutex address, and the multi-reader
+// counts in a map with its own mutex, allocated the first time two threads share the lock.
+// An idle mutex is just its state words, which matters when there are millions of them.
+// Lock order is stripe mutex, then map mutex.
+//
+// Readers normally barge past queued writers.   In fair mode a thread that doesn't already hold
+// the lock waits behind a queued writer instead, so a steady stream of readers can't starve writers.
+
 struct recursive_shared_mutex
 {
 public:
 
-    recursive_shared_mutex(bool rec_write_only = false, bool rec_one_way = false) :
-        m_mtx{}, m_exclusive_thread_id{}, m_exclusive_count{ 0 }, m_shared_locks{}, m_solo_locked{0}, m_wr_only(rec_write_only), m_one_way(rec_one_way)
+    recursive_shared_mutex(bool rec_write_only = false, bool rec_one_way = false, bool fair = false) :
+        m_state{ 0 }, m_owner{}, m_sole{}, m_readers{ nullptr }, m_exclusive_count{ 0 }, m_solo_locked{ false }, m_wr_only(rec_write_only), m_one_way(rec_one_way), m_fair(fair)
     {}
 
+    ~recursive_shared_mutex()
+    {
+        delete m_readers.load();
+    }
+
 
     void lock();
     bool try_lock();
     bool try_solo_lock();
     bool try_lock_for( const std::chrono::duration<double>& secs);
+    bool try_lock_until(const std::chrono::steady_clock::time_point &deadline);
     void unlock();
     void unlock(std::thread::id id);
 
     void lock_shared();
     bool try_lock_shared();
     bool try_lock_shared_for(const std::chrono::duration<double>& secs);
+    bool try_lock_shared_until(const std::chrono::steady_clock::time_point &deadline);
     void unlock_shared();
     void unlock_any_shared();
     void unlock_shared(std::thread::id id);
+    void adopt_shared(std::thread::id id);
+    void relock_shared();
 
     recursive_shared_mutex(const recursive_shared_mutex&) = delete;
     recursive_shared_mutex& operator=(const recursive_shared_mutex&) = delete;
 
 private:
 
-    inline bool is_exclusive_locked()
-    {
-        return m_exclusive_count > 0;
-    }
-
-    inline bool is_shared_locked()
-    {
-        return m_shared_locks.size() > 0;
-    }
-
-    inline bool can_exclusively_lock()
-    {
-        return can_start_exclusive_lock() || can_increment_exclusive_lock();
-    }
+    // state word layout
+    static const uint64_t EXCLUSIVE = 1ULL << 31;
+    static const uint64_t WAITERS = 1ULL << 30;     // the waiter queue is not empty
+    static const uint64_t MULTI = 1ULL << 29;
+    static const uint64_t WRITER_WAITING = 1ULL << 28;  // an exclusive waiter is queued
+    static const uint64_t COUNT_MASK = WRITER_WAITING - 1;
+    // bumped every time a new sole reader takes over, so a stale m_sole can't be paired with a newer state
+    static const uint64_t EPOCH = 1ULL << 32;
+
+    enum attempt { ACQUIRED, RETRY, BLOCKED };
+
+    // lives on the waiting thread's stack, linked into the stripe's queue under the stripe mutex
+    struct waiter {
+        waiter(const recursive_shared_mutex *lock, std::thread::id id, bool exclusive) : m_next(nullptr), m_lock(lock), m_id(id), m_exclusive(exclusive), m_signal(0) {}
+        waiter *m_next;
+        const recursive_shared_mutex *m_lock;
+        std::thread::id m_id;
+        bool m_exclusive;
+        std::atomic<uint32_t> m_signal;
+#ifndef __linux__
+        std::condition_variable m_cond_var;
+#endif
+    };
 
-    inline bool can_start_exclusive_lock()
-    {
-        return !is_exclusive_locked() && (!is_shared_locked() || (!m_wr_only && !m_one_way && is_shared_locked_only_on_this_thread()));
-    }
+    // waiter queue, shared by all mutexes that hash to the stripe
+    struct stripe {
+        std::mutex m_mtx;
+        waiter *m_head = nullptr;
+        waiter *m_tail = nullptr;
+    };
 
-    inline bool can_start_solo_lock()
-    {
-        return !is_exclusive_locked() && !is_shared_locked();
-    }
+    // multi-reader counts, only this mutex's readers, so they don't spill or wait on others
+    struct readers {
+        std::mutex m_mtx;
+        shared_owner_map m_counts;
+    };
 
-    inline bool can_increment_exclusive_lock()
-    {
-        return is_exclusive_locked_on_this_thread() && !m_solo_locked && (!m_one_way || !is_shared_locked());
-    }
+    static const size_t num_stripes = 256;
+    static stripe s_stripes[num_stripes];
 
-    inline bool can_lock_shared()
+    stripe &get_stripe() const
     {
-        return !is_exclusive_locked() || (!m_wr_only && is_exclusive_locked_on_this_thread());
+        auto h = reinterpret_cast<uintptr_t>(this);
+        return s_stripes[(h * 0x9E3779B97F4A7C15ULL) >> 56];
     }
 
-    inline bool is_shared_locked_only_on_this_thread()
+    readers &get_readers()
     {
-        return is_shared_locked_only_on_thread(std::this_thread::get_id());
+        // set before MULTI is, and kept until the mutex goes, so multi mode can always use it
+        auto rd = m_readers.load(std::memory_order_acquire);
+        if (rd)
+            return *rd;
+        auto fresh = new readers();
+        if (m_readers.compare_exchange_strong(rd, fresh, std::memory_order_acq_rel))
+            return *fresh;
+        delete fresh;
+        return *rd;
     }
 
-    inline bool is_shared_locked_only_on_thread(std::thread::id id)
+    size_t *find_shared(std::thread::id id)
     {
-        return m_shared_locks.size() == 1 && m_shared_locks.find(id) != m_shared_locks.end();
+        // caller holds the map mutex
+        return get_readers().m_counts.find(id);
     }
 
-    inline bool is_exclusive_locked_on_this_thread()
-    {
-        return is_exclusive_locked_on_thread(std::this_thread::get_id());
-    }
+    typedef std::chrono::steady_clock::time_point deadline_t;
 
-    inline bool is_exclusive_locked_on_thread(std::thread::id id)
+    static inline size_t shared_count(uint64_t s)
     {
-        return m_exclusive_count > 0 && m_exclusive_thread_id == id;
+        return s & COUNT_MASK;
     }
 
-    inline void start_exclusive_lock()
+    inline bool can_lock_shared(uint64_t s, std::thread::id id)
     {
-        m_exclusive_thread_id = std::this_thread::get_id();
-        m_exclusive_count++;
+        return !(s & EXCLUSIVE) || (!m_wr_only && m_owner.load(std::memory_order_relaxed) == id);
     }
 
-    inline void start_solo_lock()
+    inline bool can_lock_exclusive(uint64_t s, std::thread::id id)
     {
-        start_exclusive_lock();
-        m_solo_locked = true;
-    }
-
-    inline void increment_exclusive_lock()
-    {
-        m_exclusive_count++;
-    }
-
-    inline void decrement_exclusive_lock()
-    {
-        decrement_exclusive_lock(std::this_thread::get_id());
-    }
-
-    inline void decrement_exclusive_lock(std::thread::id tid)
-    {
-        if (m_exclusive_count == 0)
-        {
-            throw HiErr("Not exclusively locked, cannot exclusively unlock");
-        }
-        if (m_exclusive_thread_id == tid)
-        {
-            m_exclusive_count--;
-        }
-        else
-        {
-            throw HiErr("Calling exclusively unlock from the wrong thread");
+        // caller holds the stripe mutex
+        if (s & EXCLUSIVE)
+            return m_owner.load(std::memory_order_relaxed) == id && !m_solo_locked && (!m_one_way || !shared_count(s));
+        if (!shared_count(s))
+            return true;
+        if (m_wr_only || m_one_way)
+            return false;
+        if (s & MULTI) {
+            std::lock_guard<std::mutex> map_lock(get_readers().m_mtx);
+            return is_shared_locked_only_on_thread(m_state.load(), id);
         }
+        return m_sole.load(std::memory_order_relaxed) == id;
     }
 
-
-    inline void increment_shared_lock()
-    {
-        increment_shared_lock(std::this_thread::get_id());
-    }
-
-    inline void increment_shared_lock(std::thread::id id)
-    {
-        if (m_shared_locks.find(id) == m_shared_locks.end())
-        {
-            m_shared_locks[id] = 1;
-        }
-        else
-        {
-            m_shared_locks[id] += 1;
-        }
-    }
-
-    inline void decrement_shared_lock()
-    {
-        decrement_shared_lock(std::this_thread::get_id());
-    }
-
-    inline void decrement_any_shared_lock(std::thread::id id)
+    inline bool is_shared_locked_only_on_thread(uint64_t s, std::thread::id id)
     {
-        if (m_shared_locks.size() == 0)
-        {
-            throw HiErr("Not shared locked, cannot shared unlock");
-        }
-        auto pos = m_shared_locks.find(id);
-        if (pos == m_shared_locks.end())
-            pos = m_shared_locks.begin();
-        if (pos->second == 1)
-        {
-            m_shared_locks.erase(pos);
-        }
-        else
-        {
-            pos->second -= 1;
-        }
+        // caller holds the map mutex, and s is current
+        auto cnt = find_shared(id);
+        return cnt && *cnt == shared_count(s);
     }
 
-    inline void decrement_shared_lock(std::thread::id id)
+    inline bool must_yield_to_writer(uint64_t s, std::thread::id id)
     {
-        if (m_shared_locks.size() == 0)
-        {
-            throw HiErr("Not shared locked, cannot shared unlock");
-        }
-        if (m_shared_locks.find(id) == m_shared_locks.end())
-        {
-            throw HiErr("Calling shared unlock from the wrong thread");
-        }
-        else
-        {
-            if (m_shared_locks[id] == 1)
-            {
-                m_shared_locks.erase(id);
-            }
-            else
-            {
-                m_shared_locks[id] -= 1;
-            }
-        }
+        // fair mode only: a reader that holds nothing yet waits behind queued writers
+        // owners never wait, the writer may be waiting on them
+        if (!m_fair || !(s & WRITER_WAITING) || (s & EXCLUSIVE))
+            return false;
+        if (!(s & MULTI))
+            return m_sole.load(std::memory_order_relaxed) != id;
+        std::lock_guard<std::mutex> map_lock(get_readers().m_mtx);
+        return !find_shared(id);
     }
 
-    std::mutex m_mtx;
-    std::thread::id m_exclusive_thread_id;
-    size_t m_exclusive_count;
-    std::map<std::thread::id, size_t> m_shared_locks;
-    std::condition_variable m_cond_var;
+    attempt try_exclusive(std::thread::id id, uint64_t &s);
+    attempt try_solo(std::thread::id id, uint64_t &s);
+    attempt try_shared(std::thread::id id, uint64_t &s);
+    attempt add_shared(std::thread::id id, uint64_t &s);
+    attempt add_multi_shared(std::thread::id id, uint64_t &s);
+    void release_shared(std::thread::id id, bool any);
+    bool release_multi_shared(std::thread::id id, bool any);
+    void decrement_shared_lock(std::thread::id id);
+    void decrement_any_shared_lock(std::thread::id id);
+
+    template <class Attempt>
+    bool try_once(Attempt attempt);
+    template <class Attempt>
+    bool acquire(Attempt attempt, std::thread::id id, bool exclusive, const deadline_t *deadline);
+
+    void enqueue(waiter &w);
+    void dequeue(waiter &w, bool acquired);
+    bool wait_signal(waiter &w, const deadline_t *deadline);
+    void signal(waiter &w);
+    void wake_waiters();
+    void wake_waiters_locked(stripe &st);
+    bool has_waiter_locked(stripe &st, bool exclusive);
+
+    std::atomic<uint64_t> m_state;
+    std::atomic<std::thread::id> m_owner;   // exclusive owner, cleared before the exclusive bit is released
+    std::atomic<std::thread::id> m_sole;    // owner of all shared locks when not MULTI, cleared before the count drops to zero
+    std::atomic<readers *> m_readers;       // counts when MULTI, null until the first time
+    uint32_t m_exclusive_count;             // only touched by the owner
     bool m_solo_locked;
     bool m_wr_only;
     bool m_one_way;
+    bool m_fair;
 };
 
 #endif
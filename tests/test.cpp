@@ -8,6 +8,13 @@
 #include <iostream>
 #include <array>
 #include <future>
+#include <set>
+#include <map>
+
+#ifdef __linux__
+#include <sys/resource.h>
+#include <malloc.h>
+#endif
 
 void slow_increment(int &ctr) {
     int x = ctr;
@@ -20,7 +27,7 @@ TEST_CASE( "path-split-basic", "[basic]" ) {
     std::vector<std::string> res;
     auto expect = std::vector<std::string>({"a", "b", "c"});
     for (auto it=PathSplit("/a/b/c"); it != it.end(); ++it) {
-        res.push_back(*it);
+        res.emplace_back(*it);
     }
     REQUIRE(res == expect);
 }
@@ -29,7 +36,7 @@ TEST_CASE( "path-split-trims", "[basic]" ) {
     std::vector<std::string> res;
     auto expect = std::vector<std::string>({"a", "b", "c"});
     for (auto it=PathSplit("//a//b//c//"); it != it.end(); ++it) {
-        res.push_back(*it);
+        res.emplace_back(*it);
     }
     REQUIRE(res == expect);
 }
@@ -38,7 +45,7 @@ TEST_CASE( "path-split-empty", "[basic]" ) {
     std::vector<std::string> res;
     auto expect = std::vector<std::string>({});
     for (auto it=PathSplit("::::", ':'); it != it.end(); ++it) {
-        res.push_back(*it);
+        res.emplace_back(*it);
     }
     REQUIRE(res == expect);
 }
@@ -47,7 +54,7 @@ TEST_CASE( "path-split-very-empty", "[basic]" ) {
     std::vector<std::string> res;
     auto expect = std::vector<std::string>({});
     for (auto it=PathSplit(""); it != it.end(); ++it) {
-        res.push_back(*it);
+        res.emplace_back(*it);
     }
     REQUIRE(res == expect);
 }
@@ -56,11 +63,231 @@ TEST_CASE( "path-split-one", "[basic]" ) {
     std::vector<std::string> res;
     auto expect = std::vector<std::string>({"x"});
     for (auto it=PathSplit("x"); it != it.end(); ++it) {
-        res.push_back(*it);
+        res.emplace_back(*it);
     }
     REQUIRE(res == expect);
 }
 
+std::vector<std::string> split_both(std::string_view path, char sep) {
+    std::vector<std::string> res, toks;
+    for (auto it=PathSplit(path, sep); it != it.end(); ++it) {
+        res.emplace_back(*it);
+    }
+    PathTokens pt(path, sep);
+    for (size_t i = 0; i < pt.size(); ++i) {
+        toks.emplace_back(pt[i]);
+    }
+    CHECK(toks == res);
+    CHECK(pt[pt.size()].empty());
+    return toks;
+}
+
+TEST_CASE( "path-tokens", "[basic]" ) {
+    CHECK(split_both("/a/b/c", '/') == std::vector<std::string>({"a", "b", "c"}));
+    CHECK(split_both("//a//b//c//", '/').size() == 3);
+    CHECK(split_both("::::", ':').empty());
+    CHECK(split_both("", '/').empty());
+    CHECK(split_both("x", '/').size() == 1);
+    // separators on and around the 16 byte boundaries, and more components than fit inline
+    std::string deep;
+    for (int i = 0; i < 40; ++i)
+        deep += std::string(i % 17, 'a' + i % 26) + "/";
+    CHECK(split_both(deep, '/').size() == 37);
+    CHECK(split_both(std::string(100, '/') + "tail", '/').size() == 1);
+    CHECK(split_both(std::string(33, 'z'), '/').size() == 1);
+}
+
+TEST_CASE( "path-split-bench", "[.][bench]" ) {
+    // object store style paths, 200+ bytes
+    std::vector<std::string> paths;
+    for (int i = 0; i < 1000; ++i)
+        paths.push_back("tenant-" + std::to_string(i % 37) + "/data/2024/06/" + std::to_string(i % 24) + "/" + std::string(120, 'o') + "/part-" + std::to_string(i) + "/chunk-" + std::to_string(i * 7) + ".bin");
+    const int rounds = 2000;
+    size_t total = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (int r = 0; r < rounds; ++r)
+        for (auto &p : paths)
+            for (auto it = PathSplit(p); it != it.end(); ++it)
+                total += (*it).size();
+    auto mid = std::chrono::steady_clock::now();
+    for (int r = 0; r < rounds; ++r)
+        for (auto &p : paths) {
+            PathTokens pt(p);
+            for (size_t i = 0; i < pt.size(); ++i)
+                total -= pt[i].size();
+        }
+    auto end = std::chrono::steady_clock::now();
+    CHECK(total == 0);
+    auto per = [&](auto d) { return std::chrono::duration<double, std::nano>(d).count() / (rounds * paths.size()); };
+    std::cout << "PathSplit " << per(mid - start) << " ns/path, PathTokens " << per(end - mid) << " ns/path" << std::endl;
+}
+
+TEST_CASE( "name-inline-heap", "[basic]" ) {
+    CHECK(sizeof(HiName) == 24);
+    HiName a("short"), b(std::string(100, 'x'));
+    CHECK(a.view() == "short");
+    CHECK(a.heap_size() == 0);
+    CHECK(b.view() == std::string(100, 'x'));
+    CHECK(b.heap_size() == 100);
+    HiName c(b), d(std::move(a));
+    CHECK(c == b);
+    CHECK(d.view() == "short");
+    a = c;
+    c = std::move(d);
+    CHECK(a == b);
+    CHECK(c.view() == "short");
+    CHECK(std::hash<HiName>()(c) == std::hash<std::string_view>()("short"));
+}
+
+TEST_CASE( "node-key-views", "[basic]" ) {
+    typedef HiLokT<HiPolicy<HiFlags::RECURSIVE>> lok_type;
+    typedef lok_type::key_type key_type;
+    auto h = std::make_shared<lok_type>('/');
+    auto l1 = h->read(h, "a");
+    std::string path = "a/b", other = "b";
+    key_type k1(std::string_view(path).substr(2)), k2(other), k3(std::string_view(path).substr(0, 1));
+    INFO("keys compare by name, not by where the name lives");
+    CHECK(k1 == k2);
+    CHECK(k1.m_hash == k2.m_hash);
+    CHECK(k1 != k3);
+    std::string long_name(40, 'n');
+    auto l2 = h->write(h, "a/" + long_name);
+    CHECK(h->find_node("a/" + long_name));
+    h->rename("a/" + long_name, "a/b/" + long_name);
+    CHECK(!h->find_node("a/" + long_name));
+    CHECK(h->find_node("a/b/" + long_name));
+    l2->release();
+    l1->release();
+    CHECK(h->size() == 0);
+}
+
+TEST_CASE( "intern-names", "[basic]" ) {
+    auto h = std::make_shared<HiLok>('/', HiFlags::RECURSIVE | HiFlags::INTERN_NAMES);
+    std::string long_a(30, 'a'), long_b(30, 'b');
+    auto l1 = h->write(h, "x/" + long_a);
+    auto l2 = h->read(h, "y/" + long_a);
+    std::thread([&h, &long_a] () { CHECK_THROWS_AS(h->write(h, "x/" + long_a, false), HiErr); }).join();
+    h->rename("x/" + long_a, "x/" + long_b);
+    CHECK(h->find_node("x/" + long_b));
+    CHECK(!h->find_node("x/" + long_a));
+    CHECK(h->find_node("y/" + long_a));
+    l1->release();
+    l2->release();
+    CHECK(h->size() == 0);
+}
+
+TEST_CASE( "cache-paths", "[basic]" ) {
+    auto h = std::make_shared<HiLok>('/', HiFlags::RECURSIVE | HiFlags::CACHE_PATHS);
+    h->write(h, "a/b/c")->release();
+    // still pinned by this thread's cache
+    CHECK(h->size() == 3);
+    auto l1 = h->read(h, "a/b/c");
+    std::thread([&h] () {
+        CHECK_THROWS_AS(h->write(h, "a/b/c", false), HiErr);
+        h->read(h, "a/b/c")->release();
+    }).join();
+    l1->release();
+    h->write(h, "a/b/c")->release();
+    // a rename moves a cached node, the next lock can't use the stale chain
+    h->rename("a/b/c", "a/d");
+    CHECK(h->find_node("a/d"));
+    auto l2 = h->write(h, "a/b/c");
+    CHECK(h->find_node("a/b/c"));
+    l2->release();
+    h->flush_path_cache();
+    CHECK(h->size() == 0);
+}
+
+TEST_CASE( "cache-paths-thread-exit", "[basic]" ) {
+    auto h = std::make_shared<HiLok>('/', HiFlags::STRICT | HiFlags::CACHE_PATHS);
+    std::thread([&h] () {
+        for (int i = 0; i < 3; ++i)
+            h->write(h, "x/y/" + std::to_string(i))->release();
+        // the last path is cached for sure, the others unless their cache slots collided
+        CHECK(h->size() >= 3);
+        CHECK(h->size() <= 5);
+    }).join();
+    CHECK(h->size() == 0);
+}
+
+TEST_CASE( "prepared-path", "[basic]" ) {
+    auto h = std::make_shared<HiLok>('/', HiFlags::RECURSIVE);
+    auto p = h->prepare(h, "a/b/c");
+    CHECK(h->size() == 3);
+    for (int i = 0; i < 3; ++i) {
+        auto l1 = p->write();
+        std::thread([&h, &p] () {
+            CHECK_THROWS_AS(h->read(h, "a/b/c", false), HiErr);
+            CHECK_THROWS_AS(p->read(false), HiErr);
+            h->write(h, "a/x", false)->release();
+        }).join();
+        l1->release();
+        CHECK(h->size() == 3);
+    }
+    auto l2 = p->read();
+    std::thread([&p] () { p->read(false)->release(); }).join();
+    // the rename takes a/b/c away, the prepared path gets a fresh node on its next lock
+    l2->release();
+    h->rename("a/b/c", "a/d");
+    auto l3 = p->write();
+    CHECK(h->find_node("a/b/c"));
+    // the moved node was only kept by the stale pin
+    CHECK(!h->find_node("a/d"));
+    // the handle keeps its pin after the prepared path is gone
+    p.reset();
+    std::thread([&h] () { CHECK_THROWS_AS(h->write(h, "a/b/c", false), HiErr); }).join();
+    CHECK(h->size() == 3);
+    l3->release();
+    CHECK(h->size() == 0);
+}
+
+TEST_CASE( "prepared-rename", "[basic]" ) {
+    auto flags = GENERATE(HiFlags::STRICT, HiFlags::RECURSIVE);
+    auto shared = GENERATE(true, false);
+    auto h = std::make_shared<HiLok>('/', flags);
+    auto p = h->prepare(h, "a/x");
+    auto l1 = shared ? p->read() : p->write();
+    // the locks go with the node, the handle lets go of them where it is now
+    h->rename("a/x", "b/x");
+    std::thread([&h] () { CHECK_THROWS_AS(h->write(h, "b", false), HiErr); }).join();
+    l1->release();
+    h->write(h, "a", false)->release();
+    h->write(h, "b", false)->release();
+    p.reset();
+    CHECK(h->size() == 0);
+}
+
+TEST_CASE( "child-locks", "[basic]" ) {
+    auto h = std::make_shared<HiLok>('/', HiFlags::STRICT);
+    auto dir = h->read(h, "v/d");
+    std::vector<std::shared_ptr<HiHandle>> files;
+    for (int i = 0; i < 10; ++i)
+        files.push_back(dir->write_child("f" + std::to_string(i)));
+    CHECK(h->size() == 12);
+    std::thread([&h] () {
+        CHECK_THROWS_AS(h->read(h, "v/d/f3", false), HiErr);
+        CHECK_THROWS_AS(h->write(h, "v/d", false), HiErr);
+        h->read(h, "v/d/g", false)->release();
+    }).join();
+    // a nested child, and a failed one backs out of what it locked
+    auto sub = files[0]->read_child("x/y");
+    CHECK_THROWS_AS(dir->read_child("f1/z", false), HiErr);
+    CHECK(!h->find_node("v/d/f1/z"));
+    sub->release();
+    for (auto &f : files)
+        f->release();
+    CHECK(h->size() == 2);
+    // the parent's locks are its own
+    dir->release();
+    CHECK(h->size() == 0);
+    CHECK_THROWS_AS(dir->read_child("f1"), HiErr);
+
+    auto p = h->prepare(h, "v/d");
+    auto pd = p->read();
+    pd->write_child("f")->release();
+    CHECK(h->size() == 2);
+}
+
 TEST_CASE( "ex-lock-unlock", "[basic]" ) {
     auto h = std::make_shared<HiLok>();
     auto l1 = h->write(h, "a");
@@ -176,6 +403,10 @@ TEST_CASE( "lock-escalate-deescalate", "[basic]" ) {
     l1->release();
     auto nod = h->find_node("a");
     REQUIRE(nod);
+    CHECK(nod->name() == "a");
+    CHECK(nod->is_locked());
+    CHECK(nod->num_shared() == 1);
+    CHECK(!nod->parent());
     CHECK(thread_check_read_locked(h, "a"));
     auto l3 = h->write(h, "a", false);
     l2->release();
@@ -184,9 +415,9 @@ TEST_CASE( "lock-escalate-deescalate", "[basic]" ) {
 }
 
 void dump_map(HiLok &h) {
-    for (auto &it : h.m_map) {
-        std::cout << it.first.first << "/" << it.first.second << ":" << it.second << std::endl;
-    }
+    h.for_each_node([](const void *parent, std::string_view name, const void *node) {
+        std::cout << parent << "/" << name << ":" << node << std::endl;
+    });
 }
 
 TEST_CASE( "rename-lock", "[basic]" ) {
@@ -245,6 +476,441 @@ TEST_CASE( "loose-write-unlock", "[basic]" ) {
     auto l2 = h->read(h, "a", false);
 }
 
+TEST_CASE( "policy-lok", "[basic]" ) {
+    typedef HiLokT<HiPolicy<HiFlags::RECURSIVE | HiFlags::LOOSE_READ_UNLOCK>> lok_type;
+    static_assert(lok_type::is_recursive());
+    auto h = std::make_shared<lok_type>('/');
+    auto l1 = h->read(h, "a/b/c");
+    auto fut = std::async(std::launch::async, &lok_type::handle_type::release, l1);
+    fut.get();
+    auto l2 = h->write(h, "a/b/c", false);
+    CHECK(h->find_node("a/b/c"));
+    l2->release();
+    CHECK(h->size() == 0);
+}
+
+TEST_CASE( "node-pool-reuse", "[basic]" ) {
+    typedef HiLokT<HiPolicy<HiFlags::RECURSIVE>> lok_type;
+    auto h = std::make_shared<lok_type>('/');
+    // keep the parents, so only the leaf is freed and made again
+    auto parent = h->read(h, "a/b");
+    h->write(h, "a/b/c")->release();
+    auto cap = h->m_pool.capacity();
+    CHECK(cap == 3);
+    for (int i = 0; i < 1000; ++i)
+        h->write(h, "a/b/c")->release();
+    INFO("freed nodes are reused, not carved again");
+    CHECK(h->m_pool.capacity() == cap);
+    parent->release();
+    CHECK(h->size() == 0);
+}
+
+TEST_CASE( "value-locks", "[basic]" ) {
+    typedef HiLokT<HiPolicy<HiFlags::RECURSIVE>> lok_type;
+    lok_type h('/');
+    {
+        auto l1 = h.write_lock("a/b");
+        CHECK(l1);
+        CHECK(!l1.is_shared());
+        CHECK(h.size() == 2);
+        std::thread([&h] () { CHECK_THROWS_AS(h.read_lock("a/b", false), HiErr); }).join();
+        // moves hand over the lock, the moved from one is empty
+        lok_type::lock_type l2(std::move(l1));
+        CHECK(!l1);
+        CHECK(l2.owns_lock());
+        auto l3 = l2.read_child("c");
+        CHECK(h.size() == 3);
+        l2 = h.read_lock("x");
+        CHECK(h.find_node("a/b/c"));
+        std::thread([&h] () { h.write_lock("a/b", false); }).join();
+        CHECK(h.size() == 4);
+    }
+    CHECK(h.size() == 0);
+    lok_type::lock_type l4;
+    CHECK(!l4);
+    CHECK_THROWS_AS(l4.read_child("a"), HiErr);
+    l4.release();
+}
+
+TEST_CASE( "lock-many", "[basic]" ) {
+    typedef HiLokT<HiPolicy<HiFlags::STRICT>> lok_type;
+    auto h = std::make_shared<lok_type>('/');
+    auto hh = h->lock_many(h, {{"a/c/dst", HiMode::WRITE}, {"a/b/src", HiMode::READ}, {"a/b", HiMode::READ}, {"a/c/dst", HiMode::READ}});
+    CHECK(h->size() == 5);
+    INFO("shared ancestors are locked once");
+    CHECK(h->find_node("a")->m_mut.m_num_r == 1);
+    CHECK(h->find_node("a/b")->m_mut.m_num_r == 1);
+    std::thread([&h] () {
+        CHECK_THROWS_AS(h->write(h, "a/b", false), HiErr);
+        CHECK_THROWS_AS(h->read(h, "a/c/dst", false), HiErr);
+        h->read(h, "a/b/src", false)->release();
+        h->write(h, "a/c/other", false)->release();
+    }).join();
+    CHECK_THROWS_AS(hh->read_child("x"), HiErr);
+    hh->release();
+    CHECK(h->size() == 0);
+
+    INFO("all or nothing");
+    std::atomic<int> stage(0);
+    std::thread holder([&h, &stage] () {
+        auto held = h->write_lock("z/q");
+        stage = 1;
+        while (stage != 2)
+            std::this_thread::yield();
+    });
+    while (stage != 1)
+        std::this_thread::yield();
+    CHECK_THROWS_AS(h->lock_many(h, {{"a/x", HiMode::WRITE}, {"z/q", HiMode::READ}, {"zz", HiMode::READ}}, HiWait(false)), HiErr);
+    CHECK(h->size() == 2);
+    stage = 2;
+    holder.join();
+    CHECK(h->size() == 0);
+
+    INFO("requests in any order can't deadlock");
+    auto worker = [&h] (std::string_view first, std::string_view second) {
+        for (int i = 0; i < 500; ++i)
+            h->lock_many(h, {{first, HiMode::WRITE}, {second, HiMode::WRITE}});
+    };
+    std::thread t1(worker, "p/one", "q/two");
+    std::thread t2(worker, "q/two", "p/one");
+    t1.join();
+    t2.join();
+    CHECK(h->size() == 0);
+}
+
+TEST_CASE( "intent-modes", "[basic]" ) {
+    typedef HiLokT<HiPolicy<HiFlags::STRICT>> lok_type;
+    auto h = std::make_shared<lok_type>('/');
+
+    INFO("READ_TREE keeps writers out of the subtree, not readers");
+    auto tree = h->lock(h, "a", HiMode::READ_TREE);
+    std::thread([&h] () {
+        CHECK_THROWS_AS(h->write(h, "a/b/c", false), HiErr);
+        CHECK_THROWS_AS(h->lock(h, "a", HiMode::SIX, false), HiErr);
+        h->read(h, "a/b/c", false)->release();
+        h->lock(h, "a", HiMode::READ_TREE, false)->release();
+        h->write(h, "x/y", false)->release();
+    }).join();
+    CHECK_THROWS_AS(tree->write_child("b", false), HiErr);
+    tree->release();
+
+    INFO("a writer below keeps READ_TREE out, until it's gone");
+    auto wr = h->write(h, "a/b/c");
+    std::thread([&h] () {
+        auto start = std::chrono::steady_clock::now();
+        CHECK_THROWS_AS(h->lock(h, "a", HiMode::READ_TREE, true, 0.05), HiErr);
+        CHECK(std::chrono::steady_clock::now() - start >= std::chrono::milliseconds(50));
+        h->lock(h, "a/d", HiMode::READ_TREE, false)->release();
+        h->read(h, "a/b", false)->release();
+    }).join();
+    std::atomic<bool> got(false);
+    std::thread waiter([&h, &got] () {
+        h->lock(h, "a", HiMode::READ_TREE)->release();
+        got = true;
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    CHECK(!got);
+    wr->release();
+    waiter.join();
+    CHECK(got);
+
+    INFO("SIX reads the subtree and writes below it");
+    auto six = h->lock(h, "a", HiMode::SIX);
+    auto child = six->write_child("b/c");
+    std::thread([&h] () {
+        CHECK_THROWS_AS(h->lock(h, "a", HiMode::READ_TREE, false), HiErr);
+        CHECK_THROWS_AS(h->read(h, "a/b/c", false), HiErr);
+        CHECK_THROWS_AS(h->write(h, "a/d", false), HiErr);
+        h->read(h, "a/d", false)->release();
+        h->lock(h, "a/d", HiMode::READ_TREE, false)->release();
+    }).join();
+    child->release();
+    six->release();
+    CHECK(h->size() == 0);
+
+    INFO("a child write takes intents above its parent lock");
+    std::atomic<int> stage(0);
+    std::thread holder([&h, &stage] () {
+        auto held = h->lock(h, "a", HiMode::READ_TREE);
+        stage = 1;
+        while (stage != 2)
+            std::this_thread::yield();
+    });
+    while (stage != 1)
+        std::this_thread::yield();
+    auto rd = h->read(h, "a/b");
+    CHECK_THROWS_AS(rd->write_child("c", false), HiErr);
+    rd->read_child("c", false)->release();
+    rd->release();
+    stage = 2;
+    holder.join();
+    CHECK(h->size() == 0);
+
+    INFO("lock_many turns a READ_TREE with writes below it into SIX");
+    auto many = h->lock_many(h, {{"a/b", HiMode::WRITE}, {"a", HiMode::READ_TREE}}, HiWait(false));
+    auto word = h->find_node("a")->m_mut.m_intent.load();
+    CHECK((word & HiIntent::KIND_MASK) >> HiIntent::KIND_SHIFT == HiIntent::SIX);
+    CHECK((h->find_node("a/b")->m_mut.m_intent.load() & HiIntent::COUNT_MASK) == 0);
+    std::thread([&h] () {
+        CHECK_THROWS_AS(h->lock(h, "a", HiMode::READ_TREE, false), HiErr);
+        h->read(h, "a/c", false)->release();
+    }).join();
+    many->release();
+    CHECK(h->size() == 0);
+
+    INFO("IX counts don't saturate, writers past 13 bits of them don't wait");
+    std::vector<decltype(h->write(h, "d/0"))> writers;
+    for (int i = 0; i < 8200; ++i)
+        writers.push_back(h->write(h, "d/" + std::to_string(i), false));
+    CHECK((h->find_node("d")->m_mut.m_intent.load() & HiIntent::COUNT_MASK) == 8200);
+    for (auto &w : writers)
+        w->release();
+    CHECK(h->size() == 0);
+}
+
+template <class Lok>
+void update_counter(int updaters, int writers, int loops) {
+    auto h = std::make_shared<Lok>('/');
+    int value = 0;
+    std::vector<std::thread> threads;
+    for (int t = 0; t < updaters; ++t) {
+        threads.emplace_back([&h, &value, loops] () {
+            for (int i = 0; i < loops; ++i) {
+                auto u = h->lock(h, "d/ctr", HiMode::UPDATE);
+                int seen = value;
+                u->upgrade();
+                value = seen + 1;
+            }
+        });
+    }
+    for (int t = 0; t < writers; ++t) {
+        threads.emplace_back([&h, &value, loops] () {
+            for (int i = 0; i < loops; ++i) {
+                auto w = h->write(h, "d/ctr");
+                ++value;
+            }
+        });
+    }
+    for (auto &t : threads)
+        t.join();
+    CHECK(value == (updaters + writers) * loops);
+    CHECK(h->size() == 0);
+}
+
+TEST_CASE( "update-lock", "[basic]" ) {
+    typedef HiLokT<HiPolicy<HiFlags::STRICT>> lok_type;
+    auto h = std::make_shared<lok_type>('/');
+
+    INFO("UPDATE reads alongside readers, keeps out other updaters and writers");
+    auto upd = h->lock(h, "a/b", HiMode::UPDATE);
+    std::atomic<int> stage(0);
+    std::thread reader([&h, &stage] () {
+        CHECK_THROWS_AS(h->lock(h, "a/b", HiMode::UPDATE, false), HiErr);
+        CHECK_THROWS_AS(h->write(h, "a/b", false), HiErr);
+        CHECK_THROWS_AS(h->lock(h, "a", HiMode::READ_TREE, false), HiErr);
+        h->lock(h, "a/b", HiMode::READ_TREE, false)->release();
+        h->write(h, "a/c", false)->release();
+        auto held = h->read(h, "a/b", false);
+        stage = 1;
+        while (stage != 2)
+            std::this_thread::yield();
+    });
+    while (stage != 1)
+        std::this_thread::yield();
+
+    INFO("an upgrade waits for the readers, and stays UPDATE when it can't");
+    CHECK_THROWS_AS(upd->upgrade(false), HiErr);
+    CHECK_THROWS_AS(upd->upgrade(true, 0.05), HiErr);
+    std::thread([&h] () {
+        h->read(h, "a/b", false)->release();
+        CHECK_THROWS_AS(h->lock(h, "a/b", HiMode::UPDATE, false), HiErr);
+    }).join();
+    stage = 2;
+    reader.join();
+    upd->upgrade();
+    CHECK_THROWS_AS(upd->upgrade(), HiErr);
+    std::thread([&h] () {
+        CHECK_THROWS_AS(h->read(h, "a/b", false), HiErr);
+    }).join();
+    upd->release();
+    CHECK(h->size() == 0);
+
+    INFO("value locks upgrade too, only UPDATE ones");
+    auto val = h->update_lock("x");
+    CHECK(val.is_shared());
+    val.upgrade();
+    CHECK(!val.is_shared());
+    CHECK_THROWS_AS(h->read_lock("y").upgrade(), HiErr);
+    val.release();
+    CHECK(h->size() == 0);
+
+    INFO("a failed upgrade doesn't wait behind a queued writer, even when fair");
+    typedef HiLokT<HiPolicy<HiFlags::RECURSIVE | HiFlags::FAIR>> fair_type;
+    auto fair = std::make_shared<fair_type>('/');
+    auto fair_upd = fair->lock(fair, "a", HiMode::UPDATE);
+    std::atomic<bool> reading(false);
+    std::thread slow_reader([&fair, &reading] () {
+        auto rd = fair->read(fair, "a");
+        reading = true;
+        std::this_thread::sleep_for(std::chrono::milliseconds(500));
+        rd->release();
+    });
+    while (!reading)
+        std::this_thread::yield();
+    std::thread queued_writer([&fair] () {
+        fair->write(fair, "a")->release();
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    auto start = std::chrono::steady_clock::now();
+    CHECK_THROWS_AS(fair_upd->upgrade(false), HiErr);
+    CHECK_THROWS_AS(fair_upd->upgrade(true, 0.05), HiErr);
+    CHECK(std::chrono::steady_clock::now() - start < std::chrono::milliseconds(250));
+    fair_upd->upgrade();
+    fair_upd->release();
+    slow_reader.join();
+    queued_writer.join();
+    CHECK(fair->size() == 0);
+
+    INFO("read, upgrade, write, racing with each other and with plain writers");
+    update_counter<lok_type>(4, 2, 300);
+    update_counter<HiLokT<HiPolicy<HiFlags::RECURSIVE>>>(4, 2, 300);
+    update_counter<HiLokT<HiPolicy<HiFlags::RECURSIVE | HiFlags::FAIR>>>(4, 2, 300);
+}
+
+TEST_CASE( "idle-retention", "[basic]" ) {
+    typedef HiLokT<HiPolicy<HiFlags::RECURSIVE>> lok_type;
+    auto h = std::make_shared<lok_type>('/');
+    h->set_idle_retention(32);
+    h->write(h, "a/b/c")->release();
+    auto node = h->find_node("a/b/c").get();
+    CHECK(node);
+    CHECK(h->size() == 3);
+    for (int i = 0; i < 1000; ++i)
+        h->write(h, "a/b/c")->release();
+    INFO("a hot path keeps its nodes");
+    CHECK(h->find_node("a/b/c").get() == node);
+    CHECK(h->m_pool.capacity() == 3);
+    // cold paths push the oldest out, a/b/c is the oldest
+    // held all at once, so they get distinct nodes and land in every shard
+    {
+        std::vector<std::shared_ptr<lok_type::handle_type>> cold;
+        for (int i = 0; i < 1000; ++i)
+            cold.push_back(h->read(h, "x/" + std::to_string(i)));
+    }
+    CHECK(h->size() <= 32 + 1);
+    CHECK(!h->find_node("a/b/c"));
+    CHECK(h->find_node("x/999"));
+    h->set_idle_retention(0);
+    CHECK(h->size() == 0);
+}
+
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+size_t heap_in_use() {
+    return mallinfo2().uordblks;
+}
+
+template <int Flags>
+size_t node_heap_bytes() {
+    // heap per live node, malloc overhead included: n leaves each held by one handle, less n handles on one leaf
+    const size_t n = 4096;
+    typedef HiLokT<HiPolicy<Flags>> lok_type;
+    auto h = std::make_shared<lok_type>('/');
+    std::vector<std::shared_ptr<typename lok_type::handle_type>> handles;
+    handles.reserve(n);
+    size_t start = heap_in_use();
+    for (size_t i = 0; i < n; ++i)
+        handles.push_back(h->read(h, "node" + std::to_string(i)));
+    size_t many = heap_in_use() - start;
+    handles.clear();
+    start = heap_in_use();
+    for (size_t i = 0; i < n; ++i)
+        handles.push_back(h->read(h, "node"));
+    size_t one = heap_in_use() - start;
+    return (many - one) / n;
+}
+
+TEST_CASE( "node-footprint", "[basic]" ) {
+    typedef HiLokT<HiPolicy<HiFlags::RECURSIVE>>::node_type node_type;
+    typedef HiLokT<HiPolicy<HiFlags::STRICT>>::node_type strict_node_type;
+    auto rec_heap = node_heap_bytes<HiFlags::RECURSIVE>();
+    auto strict_heap = node_heap_bytes<HiFlags::STRICT>();
+    std::cout << "node size: recursive " << sizeof(node_type) << " strict " << sizeof(strict_node_type) << std::endl;
+    std::cout << "node heap: recursive " << rec_heap << " strict " << strict_heap << std::endl;
+    CHECK(sizeof(node_type) <= 104);
+    CHECK(sizeof(strict_node_type) <= 120);
+    INFO("node, control block, and table entry");
+    CHECK(rec_heap <= 256);
+    CHECK(strict_heap <= 272);
+}
+
+#ifndef __SANITIZE_THREAD__
+// tsan has its own allocator, mallinfo doesn't see it
+size_t long_names_heap_bytes(bool intern) {
+    // the same long name under many parents
+    const size_t n = 1024;
+    typedef HiLokT<HiPolicy<HiFlags::RECURSIVE>> lok_type;
+    auto h = std::make_shared<lok_type>('/', intern ? HiFlags::INTERN_NAMES : 0);
+    std::vector<std::shared_ptr<lok_type::handle_type>> handles;
+    handles.reserve(n);
+    std::string name(64, 't');
+    size_t start = heap_in_use();
+    for (size_t i = 0; i < n; ++i)
+        handles.push_back(h->read(h, std::to_string(i) + "/" + name));
+    size_t used = heap_in_use() - start;
+    if (intern)
+        CHECK(h->m_names->size() == 1);
+    handles.clear();
+    CHECK(h->size() == 0);
+    if (intern)
+        CHECK(h->m_names->size() == 0);
+    return used;
+}
+
+TEST_CASE( "intern-names-footprint", "[basic]" ) {
+    auto plain = long_names_heap_bytes(false);
+    auto interned = long_names_heap_bytes(true);
+    std::cout << "long names heap: plain " << plain << " interned " << interned << std::endl;
+    INFO("each node saves its own copy of the name");
+    CHECK(interned + 1024 * 64 <= plain);
+}
+#endif
+#endif
+
+TEST_CASE( "rename-below-itself", "[basic]" ) {
+    auto h = std::make_shared<HiLok>();
+    auto l1 = h->write(h, "a/b");
+    CHECK_THROWS_AS(h->rename("a/b", "a/b/c"), HiErr);
+    CHECK_THROWS_AS(h->rename("a/b", ""), HiErr);
+    CHECK(h->find_node("a/b"));
+    CHECK(h->size() == 2);
+    l1->release();
+    CHECK(h->size() == 0);
+}
+
+TEST_CASE( "trie-walk", "[basic]" ) {
+    auto h = std::make_shared<HiLok>();
+    auto l1 = h->read(h, "a/b/c");
+    auto l2 = h->read(h, "a/d");
+    auto l3 = h->read(h, "e");
+    std::map<std::string, const void *> nodes;
+    std::vector<std::pair<const void *, std::string>> parents;
+    h->for_each_node([&](const void *parent, std::string_view name, const void *node) {
+        nodes[std::string(name)] = node;
+        parents.emplace_back(parent, std::string(name));
+    });
+    CHECK(nodes.size() == 5);
+    INFO("every parent is visited before its children");
+    std::set<const void *> seen = {nullptr};
+    for (auto &it : parents) {
+        CHECK(seen.count(it.first));
+        seen.insert(nodes[it.second]);
+    }
+    l1->release();
+    l2->release();
+    l3->release();
+    CHECK(h->size() == 0);
+}
+
 TEST_CASE( "rename-read-deep", "[basic]" ) {
     auto i = GENERATE(HiFlags::RECURSIVE, HiFlags::STRICT);
     DYNAMIC_SECTION("recursive " << i) {
@@ -352,6 +1018,296 @@ TEST_CASE( "shared-simple", "[basic]" ) {
     CHECK(!h.is_locked());
 }
 
+void warm_bias(HiMutex &h) {
+    // enough slow-path reads to turn the bias on
+    for (int i = 0; i < 100; ++i) {
+        h.lock_shared();
+        h.unlock_shared();
+    }
+}
+
+bool thread_try_lock(HiMutex &h) {
+    bool ok = false;
+    std::thread([&h, &ok] () { ok = h.try_lock(); if (ok) h.unlock(); }).join();
+    return ok;
+}
+
+TEST_CASE( "biased-fast-read", "[basic]" ) {
+    auto i = GENERATE(HiFlags::RECURSIVE, HiFlags::STRICT, HiFlags::RECURSIVE_ONEWAY);
+    DYNAMIC_SECTION("recursive " << i) {
+    HiMutex h(i | HiFlags::READ_BIASED);
+    warm_bias(h);
+    h.lock_shared();
+    INFO("fast reader never touches the shared count");
+    CHECK(h.num_shared() == 0);
+    CHECK(!thread_try_lock(h));
+    INFO("writer migrated the fast reader");
+    CHECK(h.num_shared() == 1);
+    h.unlock_shared();
+    CHECK(thread_try_lock(h));
+    CHECK(!h.is_locked());
+    }
+}
+
+TEST_CASE( "biased-escalate", "[basic]" ) {
+    HiMutex h(HiFlags::RECURSIVE | HiFlags::READ_BIASED);
+    warm_bias(h);
+    h.lock_shared();
+    CHECK(h.try_lock());
+    INFO("no bias while a writer holds the lock");
+    CHECK(h.try_lock_shared());
+    CHECK(h.num_shared() == 2);
+    h.unlock_shared();
+    h.unlock();
+    h.unlock_shared();
+    CHECK(!h.is_locked());
+}
+
+TEST_CASE( "biased-loose-unlock", "[basic]" ) {
+    HiMutex h(HiFlags::RECURSIVE | HiFlags::READ_BIASED);
+    warm_bias(h);
+    h.lock_shared();
+    auto tid = std::this_thread::get_id();
+    std::thread([&h, tid] () { h.unlock_shared(tid); }).join();
+    CHECK(!h.is_locked());
+    CHECK(thread_try_lock(h));
+}
+
+TEST_CASE( "shared-multi-escalate", "[basic]" ) {
+    HiMutex h(HiFlags::RECURSIVE);
+    h.lock_shared();
+    h.lock_shared();
+    std::promise<void> locked, done;
+    std::thread other([&h, &locked, &done] () {
+        h.lock_shared();
+        locked.set_value();
+        done.get_future().wait();
+        h.unlock_shared();
+    });
+    locked.get_future().wait();
+    INFO("another thread holds a shared lock, no escalation");
+    CHECK(!h.try_lock());
+    CHECK(!h.try_solo_lock());
+    done.set_value();
+    other.join();
+    INFO("only our shared locks are left");
+    CHECK(h.try_lock());
+    h.unlock();
+    h.unlock_shared();
+    h.unlock_shared();
+    CHECK(!h.is_locked());
+    CHECK(h.try_solo_lock());
+    h.unlock();
+}
+
+TEST_CASE( "shared-owner-map", "[basic]" ) {
+    shared_owner_map m;
+    std::vector<std::thread::id> ids;
+    std::vector<std::thread> threads;
+    for (int i = 0; i < 10; ++i) {
+        threads.emplace_back([] () {});
+        ids.push_back(threads.back().get_id());
+    }
+    for (size_t i = 0; i < ids.size(); ++i)
+        m.add(ids[i], i + 1);
+    CHECK(m.size() == 10);
+    for (size_t i = 0; i < ids.size(); ++i) {
+        REQUIRE(m.find(ids[i]));
+        CHECK(*m.find(ids[i]) == i + 1);
+    }
+    m.release(ids[0]);
+    CHECK(!m.find(ids[0]));
+    CHECK(m.size() == 9);
+    m.add(ids[0]);
+    m.add(ids[9]);
+    CHECK(*m.find(ids[9]) == 11);
+    while (m.size()) {
+        CHECK(m.find(m.first()));
+        m.release(m.first());
+    }
+    for (auto id : ids)
+        CHECK(!m.find(id));
+    CHECK(m.size() == 0);
+    for (auto &thread : threads)
+        thread.join();
+}
+
+TEST_CASE( "shared-many-owners", "[basic]" ) {
+    HiMutex h(HiFlags::RECURSIVE);
+    const int pool_size = 12;
+    std::atomic<int> held(0);
+    std::promise<void> go;
+    auto release = go.get_future().share();
+    std::vector<std::thread> threads;
+    for (int i = 0; i < pool_size; ++i) {
+        threads.emplace_back([&h, &held, release] () {
+            h.lock_shared();
+            h.lock_shared();
+            held++;
+            release.wait();
+            h.unlock_shared();
+            h.unlock_shared();
+        });
+    }
+    while (held < pool_size)
+        std::this_thread::yield();
+    CHECK(!h.try_lock());
+    go.set_value();
+    for (auto &thread : threads)
+        thread.join();
+    CHECK(!h.is_locked());
+    CHECK(h.try_lock());
+    h.unlock();
+}
+
+TEST_CASE( "shared-wrong-thread", "[basic]" ) {
+    HiMutex h(HiFlags::RECURSIVE);
+    h.lock_shared();
+    std::thread([&h] () { CHECK_THROWS_AS(h.unlock_shared(), HiErr); }).join();
+    h.unlock_shared();
+    CHECK_THROWS_AS(h.unlock_shared(), HiErr);
+    CHECK_THROWS_AS(h.unlock(), HiErr);
+}
+
+TEST_CASE( "rlock-timed-wait", "[basic]" ) {
+    HiMutex h(HiFlags::RECURSIVE);
+    h.lock();
+    std::thread([&h] () {
+        auto start = std::chrono::steady_clock::now();
+        CHECK(!h.try_lock_shared_for(0.01));
+        CHECK(!h.try_lock_for(0.01));
+        auto dur = std::chrono::duration<double>(std::chrono::steady_clock::now() - start);
+        CHECK(dur.count() >= 0.02);
+    }).join();
+    std::thread waiter([&h] () {
+        CHECK(h.try_lock_shared_for(10));
+        h.unlock_shared();
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    h.unlock();
+    waiter.join();
+    CHECK(!h.is_locked());
+}
+
+TEST_CASE( "queued-escalate", "[basic]" ) {
+    HiMutex h(HiFlags::RECURSIVE);
+    h.lock_shared();
+    std::promise<void> locked, done;
+    std::thread reader([&h, &locked, &done] () {
+        h.lock_shared();
+        locked.set_value();
+        done.get_future().wait();
+        h.unlock_shared();
+    });
+    locked.get_future().wait();
+    std::atomic<bool> wrote(false);
+    std::thread writer([&h, &wrote] () { h.lock(); wrote = true; h.unlock(); });
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    std::thread release([&done] () { std::this_thread::sleep_for(std::chrono::milliseconds(10)); done.set_value(); });
+    INFO("escalation queued behind a waiting writer still gets through");
+    h.lock();
+    CHECK(!wrote);
+    h.unlock();
+    h.unlock_shared();
+    reader.join();
+    writer.join();
+    release.join();
+    CHECK(wrote);
+}
+
+TEST_CASE( "fair-reader-waits", "[basic]" ) {
+    auto fair = GENERATE(0, (int)HiFlags::FAIR);
+    DYNAMIC_SECTION("fair " << fair) {
+    HiMutex h(HiFlags::RECURSIVE | fair);
+    h.lock_shared();
+    std::atomic<bool> wrote(false);
+    std::thread writer([&h, &wrote] () { h.lock(); wrote = true; h.unlock(); });
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    bool other_read = false;
+    std::thread([&h, &other_read] () { other_read = h.try_lock_shared(); if (other_read) h.unlock_shared(); }).join();
+    INFO("a new reader only passes a waiting writer when not fair");
+    CHECK(other_read == !fair);
+    INFO("the holder can always read again");
+    CHECK(h.try_lock_shared());
+    h.unlock_shared();
+    h.unlock_shared();
+    writer.join();
+    CHECK(wrote);
+    }
+}
+
+#ifdef __linux__
+TEST_CASE( "queued-writer-wakeups", "[basic]" ) {
+    // a writer waiting behind many readers should be woken once, not once per reader release
+    HiMutex mut(HiFlags::RECURSIVE);
+    const int pool_size = 100;
+    std::atomic<int> held(0);
+    std::promise<void> go;
+    auto release = go.get_future().share();
+    std::vector<std::thread> threads;
+    for(int i = 0; i < pool_size; ++i) {
+        threads.emplace_back(std::thread([&mut, &held, release] () {
+            mut.lock_shared();
+            held++;
+            release.wait();
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+            mut.unlock_shared();
+        }));
+    }
+    while (held < pool_size)
+        std::this_thread::yield();
+    long switches = 0;
+    std::thread writer([&mut, &switches] () {
+        struct rusage before, after;
+        getrusage(RUSAGE_THREAD, &before);
+        mut.lock();
+        getrusage(RUSAGE_THREAD, &after);
+        mut.unlock();
+        switches = after.ru_nvcsw - before.ru_nvcsw;
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    go.set_value();
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    writer.join();
+    std::cout << "writer context switches: " << switches << std::endl;
+    CHECK(switches < pool_size / 4);
+}
+#endif
+
+void mixed_worker(int i, HiMutex &h, int &ctr) {
+    for (int j = 0; j < 20; ++j) {
+        if ((i + j) % 4 == 0) {
+            h.lock();
+            slow_increment(ctr);
+            h.unlock();
+        } else {
+            h.lock_shared();
+            h.lock_shared();
+            h.unlock_shared();
+            h.unlock_shared();
+        }
+    }
+}
+
+TEST_CASE( "mixed-lock-thread", "[basic]" ) {
+    HiMutex mut(HiFlags::RECURSIVE);
+    int ctr = 0;
+    int pool_size = 20;
+    std::vector<std::thread> threads;
+    for(int i = 0; i < pool_size; ++i)
+    {
+        threads.emplace_back(std::thread([&mut, &ctr, i] () { mixed_worker(i, mut, ctr); } ));
+    }
+
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    CHECK(ctr == pool_size * 5);
+    CHECK(mut.is_locked() == false);
+}
+
 void hold_lock_until(std::shared_ptr<HiLok> h, std::string p1, std::string p2) {
     auto wr1 = h->write(h, p1);
     auto wr2 = h->write(h, p2);
@@ -402,6 +1358,55 @@ TEST_CASE( "timed-hlock", "[basic]" ) {
     }
 }
 
+TEST_CASE( "timed-whole-path", "[basic]" ) {
+    auto h = std::make_shared<HiLok>('/', HiFlags::RECURSIVE);
+    std::atomic<bool> ready(false);
+    std::atomic<bool> done(false);
+
+    // the reader waits on "a" until the holder lets it go, then on "a/b/c"
+    auto thread = std::thread([&] () {
+        auto top = h->write(h, "a");
+        auto mid = h->write(h, "a/b/c");
+        ready = true;
+        std::this_thread::sleep_for(std::chrono::milliseconds(250));
+        top->release();
+        while (!done)
+            std::this_thread::yield();
+    });
+    while (!ready)
+        std::this_thread::yield();
+
+    INFO("one timeout for both waits");
+    {
+    auto start = std::chrono::steady_clock::now();
+    REQUIRE_THROWS_AS(h->read(h, "a/b/c/d/e", true, 0.4), HiErr);
+    auto dur = std::chrono::duration<double>(std::chrono::steady_clock::now() - start);
+    CHECK(dur.count() >= 0.4);
+    CHECK(dur.count() < 0.6);
+    }
+
+    INFO("a deadline that has passed only tries");
+    {
+    auto past = std::chrono::steady_clock::now() - std::chrono::seconds(1);
+    REQUIRE_THROWS_AS(h->write_until(h, "a/b/c", past), HiErr);
+    h->read_until(h, "a/b", past)->release();
+    }
+
+    INFO("renames wait for the destination the same way");
+    {
+    auto leaf = h->read(h, "x");
+    auto start = std::chrono::steady_clock::now();
+    REQUIRE_THROWS_AS(h->rename("x", "a/b/c/x", true, 0.05), HiErr);
+    auto dur = std::chrono::duration<double>(std::chrono::steady_clock::now() - start);
+    CHECK(dur.count() >= 0.05);
+    CHECK(h->find_node("x"));
+    }
+
+    done = true;
+    thread.join();
+    CHECK(h->size() == 0);
+}
+
 
 void shared_lock_worker(int, HiMutex &h) {
     h.lock_shared();
@@ -481,6 +1486,97 @@ TEST_CASE( "deep-many-threads", "[basic]" ) {
 }
 
 
+void disjoint_worker(int i, std::shared_ptr<HiLok> h, std::vector<int> &ctr) {
+    // pairs of threads share a subtree, unrelated subtrees should not interfere
+    auto path = "t" + std::to_string(i % 5) + "/x/y";
+    for (int j = 0; j < 50; ++j) {
+        h->write(h, path)->release();
+        h->read(h, path)->release();
+    }
+    auto l1 = h->write(h, path);
+    slow_increment(ctr[i % 5]);
+    l1->release();
+}
+
+TEST_CASE( "disjoint-many-threads", "[basic]" ) {
+    auto h = std::make_shared<HiLok>();
+    std::vector<int> ctr(5);
+    int pool_size = 10;
+    std::vector<std::thread> threads;
+    for(int i = 0; i < pool_size; ++i)
+    {
+        threads.emplace_back(std::thread([&h, &ctr, i] () { disjoint_worker(i, h, ctr); } ));
+    }
+
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    for (auto c : ctr) {
+        CHECK(c == 2);
+    }
+    CHECK(h->size() == 0);
+}
+
+
+TEST_CASE( "defer-erase", "[basic]" ) {
+    auto h = std::make_shared<HiLok>('/', HiFlags::RECURSIVE | HiFlags::DEFER_ERASE);
+    h->write(h, "a/b/c")->release();
+    CHECK(h->size() == 3);
+    CHECK(h->find_node("a/b/c"));
+    h->reclaim();
+    CHECK(h->size() == 0);
+    // a full batch is erased by the release that fills it
+    for (int i = 0; i < 64; ++i)
+        h->read(h, "x/" + std::to_string(i))->release();
+    CHECK(h->size() == 0);
+    // a retired node that's locked again stays
+    h->write(h, "a/b")->release();
+    auto l1 = h->read(h, "a/b");
+    h->reclaim();
+    CHECK(h->size() == 2);
+    l1->release();
+    h->reclaim();
+    CHECK(h->size() == 0);
+}
+
+TEST_CASE( "defer-erase-many-threads", "[basic]" ) {
+    auto h = std::make_shared<HiLok>('/', HiFlags::RECURSIVE | HiFlags::DEFER_ERASE);
+    std::vector<std::thread> threads;
+    for (int i = 0; i < 8; ++i) {
+        threads.emplace_back([&h, i] () {
+            for (int j = 0; j < 500; ++j) {
+                auto l1 = h->read(h, "a/" + std::to_string((i + j) % 5));
+                h->write(h, "a/" + std::to_string((i + j) % 5) + "/" + std::to_string(j % 7))->release();
+                l1->release();
+            }
+        });
+    }
+    for (auto& thread : threads)
+        thread.join();
+    h->reclaim();
+    CHECK(h->size() == 0);
+}
+
+TEST_CASE( "retention-many-threads", "[basic]" ) {
+    auto h = std::make_shared<HiLok>();
+    h->set_idle_retention(8);
+    std::vector<std::thread> threads;
+    for (int i = 0; i < 8; ++i) {
+        threads.emplace_back([&h, i] () {
+            for (int j = 0; j < 500; ++j) {
+                auto l1 = h->read(h, "a/" + std::to_string((i + j) % 5));
+                h->write(h, "a/" + std::to_string((i + j) % 5) + "/" + std::to_string(j % 7))->release();
+                l1->release();
+            }
+        });
+    }
+    for (auto& thread : threads)
+        thread.join();
+    h->set_idle_retention(0);
+    CHECK(h->size() == 0);
+}
+
+
 void nesty_worker(int, std::shared_ptr<HiLok> h, int &ctr) {
     auto l2 = h->read(h, "a/b/c");
     auto l1 = h->write(h, "a/b/c/d/e");
@@ -515,6 +1611,40 @@ void randy_worker(int i, std::shared_ptr<HiLok> &h, int &ctr) {
     l1->release();
 }
 
+void biased_worker(int i, std::shared_ptr<HiLok> &h, std::vector<int> &ctr) {
+    // everyone reads the hot top-level node, a few threads write it
+    for (int j = 0; j < 20; ++j) {
+        if (i % 10 == 0) {
+            auto l1 = h->write(h, "tenant");
+            slow_increment(ctr[0]);
+            l1->release();
+        } else {
+            auto l1 = h->write(h, "tenant/" + std::to_string(i % 3) + "/f");
+            ctr[1 + i % 3]++;
+            l1->release();
+        }
+    }
+}
+
+TEST_CASE( "biased-threads", "[basic]" ) {
+    auto h = std::make_shared<HiLok>('/', HiFlags::RECURSIVE | HiFlags::READ_BIASED);
+    int pool_size = 30;
+    std::vector<std::thread> threads;
+    std::vector<int> ctr(4);
+    for(int i = 0; i < pool_size; ++i)
+    {
+        threads.emplace_back(std::thread([&h, &ctr, i] () { biased_worker(i, h, ctr); } ));
+    }
+
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    CHECK(ctr[0] == 3 * 20);
+    CHECK(ctr[1] + ctr[2] + ctr[3] == 27 * 20);
+    CHECK(ctr[1] == 9 * 20);
+    CHECK(h->size() == 0);
+}
+
 TEST_CASE( "randy-threads", "[basic]" ) {
     auto h = std::make_shared<HiLok>();
     int ctr = 0;
@@ -568,6 +1698,126 @@ void rename_other_lock(std::shared_ptr<HiLok> &h) {
 }
 
 
+TEST_CASE( "rename-waits-outside-tables", "[basic]" ) {
+    auto h = std::make_shared<HiLok>('/', HiFlags::RECURSIVE);
+    auto dest = h->write(h, "d");
+    std::atomic<bool> started(false);
+    std::thread thread([&h, &started] () {
+        auto leaf = h->read(h, "x");
+        started = true;
+        h->rename("x", "d/x", true, 5);
+        CHECK(h->find_node("d/x"));
+        CHECK(!h->find_node("x"));
+        leaf->release();
+    });
+    while (!started)
+        std::this_thread::yield();
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+
+    INFO("a rename waiting on its destination doesn't hold up the tables it will change");
+    auto start = std::chrono::steady_clock::now();
+    h->write(h, "y")->release();
+    h->read(h, "x2/z")->release();
+    auto dur = std::chrono::duration<double>(std::chrono::steady_clock::now() - start);
+    CHECK(dur.count() < 1);
+    CHECK(h->find_node("x"));
+
+    dest->release();
+    thread.join();
+    CHECK(h->size() == 0);
+}
+
+TEST_CASE( "rename-recounts", "[basic]" ) {
+    // the rename thread owns the locks it clones, recursive ones could only be released by it
+    auto flags = GENERATE(HiFlags::STRICT, HiFlags::STRICT | HiFlags::READ_BIASED);
+    auto h = std::make_shared<HiLok>('/', flags);
+    auto l1 = h->read(h, "a/x");
+    auto dest = h->write(h, "b");
+    std::thread mover([&h] () { h->rename("a/x", "b/x"); });
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+
+    INFO("a reader that comes in while the rename waits on its destination is moved with the others");
+    std::atomic<int> stage(0);
+    std::thread reader([&h, &stage] () {
+        auto l2 = h->read(h, "a/x");
+        stage = 1;
+        while (stage != 2)
+            std::this_thread::yield();
+        l2->release();
+    });
+    while (stage != 1)
+        std::this_thread::yield();
+    dest->release();
+    mover.join();
+    CHECK(h->find_node("b/x"));
+    CHECK(!h->find_node("a"));
+    stage = 2;
+    reader.join();
+    std::thread([&h] () { CHECK_THROWS_AS(h->write(h, "b", false), HiErr); }).join();
+    l1->release();
+    h->write(h, "b", false)->release();
+    CHECK(h->size() == 0);
+}
+
+TEST_CASE( "rename-many", "[basic]" ) {
+    auto h = std::make_shared<HiLok>('/', HiFlags::RECURSIVE);
+    std::vector<std::string> names;
+    std::vector<std::shared_ptr<HiHandle>> held;
+    for (int i = 0; i < 100; ++i) {
+        names.push_back("f" + std::to_string(i));
+        held.push_back(h->read(h, "a/" + names.back()));
+    }
+    auto moves_between = [&names] (const std::string &from, const std::string &to) {
+        std::vector<std::pair<std::string, std::string>> paths;
+        for (auto &name : names)
+            paths.emplace_back(from + name, to + name);
+        return paths;
+    };
+    auto as_views = [] (const std::vector<std::pair<std::string, std::string>> &paths) {
+        return std::vector<std::pair<std::string_view, std::string_view>>(paths.begin(), paths.end());
+    };
+
+    auto into_b = moves_between("a/", "b/");
+    h->rename_many(as_views(into_b));
+    CHECK(h->find_node("b/f42"));
+    CHECK(!h->find_node("a"));
+    CHECK(h->size() == 101);
+    std::thread([&h] () { CHECK_THROWS_AS(h->write(h, "b/f42", false), HiErr); }).join();
+
+    INFO("all or nothing");
+    auto into_c = moves_between("b/", "c/");
+    into_c.emplace_back("b/missing", "c/missing");
+    CHECK_THROWS_AS(h->rename_many(as_views(into_c)), HiErr);
+    CHECK(h->find_node("b/f0"));
+    CHECK(h->size() == 101);
+    CHECK_THROWS_AS(h->rename_many({{"b/f0", "c"}, {"b/f1", "c/f1"}}), HiErr);
+    CHECK_THROWS_AS(h->rename_many({{"b/f0", "c/x"}, {"b/f0/y", "d"}}), HiErr);
+    CHECK(h->size() == 101);
+
+    INFO("one deadline for all the destinations");
+    std::atomic<int> stage(0);
+    std::thread holder([&h, &stage] () {
+        auto dest = h->write(h, "c");
+        stage = 1;
+        while (stage != 2)
+            std::this_thread::yield();
+    });
+    while (stage != 1)
+        std::this_thread::yield();
+    into_c.pop_back();
+    auto start = std::chrono::steady_clock::now();
+    CHECK_THROWS_AS(h->rename_many(as_views(into_c), true, 0.05), HiErr);
+    auto dur = std::chrono::duration<double>(std::chrono::steady_clock::now() - start);
+    CHECK(dur.count() < 1);
+    CHECK(h->find_node("b/f99"));
+    CHECK(h->size() == 102);
+
+    stage = 2;
+    holder.join();
+    held.clear();
+    CHECK(h->size() == 0);
+}
+
 TEST_CASE( "rename-wrong-thread", "[basic]" ) {
     auto h = std::make_shared<HiLok>('/', HiFlags::RECURSIVE_ONEWAY | HiFlags::LOOSE_READ_UNLOCK);
     auto ll = h->read(h, "a/b/c");
@@ -1,5 +1,5 @@
 import pytest
-from hilok import HiLok, HiLokError, HiLokFlags
+from hilok import HiLok, HiLokError, HiLokFlags, HiLokMode
 
 
 def test_wr_no_lev():
@@ -115,3 +115,98 @@ def test_other_sep():
     with h.read("a:b"):
         with pytest.raises(HiLokError):
             h.write("a", block=False)
+
+
+def test_prepared():
+    h = HiLok(flags=0)
+    p = h.prepare("/a/b")
+    for _ in range(3):
+        with p.write():
+            with pytest.raises(HiLokError):
+                h.read("/a/b", block=False)
+    with p.read():
+        with h.read("/a/b", block=False):
+            pass
+        with pytest.raises(HiLokError):
+            p.write(block=False)
+
+
+def test_child():
+    h = HiLok(flags=0)
+    with h.read("/a/b") as d:
+        with d.write_child("c/d"):
+            with pytest.raises(HiLokError):
+                h.read("/a/b/c/d", block=False)
+        with d.read_child("c"):
+            with pytest.raises(HiLokError):
+                h.write("/a/b/c", block=False)
+
+
+def test_rename_many():
+    h = HiLok()
+    held = [h.read("/a/f%d" % i) for i in range(10)]
+    h.rename_many([("/a/f%d" % i, "/b/f%d" % i) for i in range(10)])
+    with pytest.raises(HiLokError):
+        h.write("/b/f3", block=False)
+    with h.write("/a/f3", block=False):
+        pass
+    # all or nothing
+    with pytest.raises(HiLokError):
+        h.rename_many([("/b/f0", "/c/f0"), ("/notthere", "/c/x")])
+    with pytest.raises(HiLokError):
+        h.write("/b/f0", block=False)
+    with pytest.raises(HiLokError):
+        h.rename_many([("/b/f0", "/c"), ("/b/f1", "/c/f1")])
+    for l in held:
+        l.release()
+
+
+def test_lock_many():
+    h = HiLok(flags=HiLokFlags.STRICT)
+    with h.lock_many([("/a/dst", HiLokMode.WRITE), ("/a/src", HiLokMode.READ)]):
+        with pytest.raises(HiLokError):
+            h.read("/a/dst", block=False)
+        with h.read("/a/src", block=False):
+            pass
+    with h.write("/a/dst", block=False):
+        with pytest.raises(HiLokError):
+            h.lock_many([("/a/src", HiLokMode.READ), ("/a/dst", HiLokMode.READ)], block=False)
+    with h.write("/a/src", block=False):
+        pass
+
+
+def test_intent_modes():
+    h = HiLok(flags=HiLokFlags.STRICT)
+    with h.lock("/a", HiLokMode.READ_TREE):
+        with pytest.raises(HiLokError):
+            h.write("/a/b/c", block=False)
+        with h.read("/a/b/c", block=False):
+            pass
+    with h.write("/a/b/c"):
+        with pytest.raises(HiLokError):
+            h.lock("/a", HiLokMode.READ_TREE, timeout=0.01)
+        with h.lock("/a/d", HiLokMode.READ_TREE, block=False):
+            pass
+    with h.lock("/a", HiLokMode.SIX) as six:
+        with six.write_child("b/c"):
+            pass
+        with pytest.raises(HiLokError):
+            h.lock("/a", HiLokMode.READ_TREE, block=False)
+    assert h.size() == 0
+
+
+def test_update_lock():
+    h = HiLok(flags=HiLokFlags.STRICT)
+    with h.lock("/a/b", HiLokMode.UPDATE) as u:
+        with pytest.raises(HiLokError):
+            h.lock("/a/b", HiLokMode.UPDATE, block=False)
+        with h.read("/a/b", block=False):
+            with pytest.raises(HiLokError):
+                u.upgrade(timeout=0.01)
+        u.upgrade()
+        with pytest.raises(HiLokError):
+            h.read("/a/b", block=False)
+    with h.read("/a/b") as r:
+        with pytest.raises(HiLokError):
+            r.upgrade()
+    assert h.size() == 0